@@ -44,10 +44,11 @@
 /* #include <ctype.h> */
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/wait.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-/* #include <string.h> */
+#include <string.h>
 #include <fcntl.h>
 
 /* #define USERNAME_MAX_LEN 32 */
@@ -59,11 +60,115 @@ unsigned pflags = 0;
 static inline void
 usage(char *prog)
 {
-	fprintf(stderr, "Usage: %s [-S PATH] [[-rs] QUERY...]\n", prog);
+	fprintf(stderr, "Usage: %s [-bj] [-S PATH] [-n NAME] [-l N] [[-rs] QUERY...]\n", prog);
 	fprintf(stderr, "    Options:\n");
 	fprintf(stderr, "        -r QUERY  Only always present.\n");
 	fprintf(stderr, "        -s QUERY  Show splits.\n");
-	fprintf(stderr, "        -s PATH   Set socket path.\n");
+	fprintf(stderr, "        -S PATH   Set socket path.\n");
+	fprintf(stderr, "        -n NAME   Use dataset NAME.\n");
+	fprintf(stderr, "        -b        Send the QUERY dates as one BATCH.\n");
+	fprintf(stderr, "        -l N      Get replies in pages of N rows.\n");
+	fprintf(stderr, "        -j        JOIN the rows in stdin with who was present.\n");
+}
+
+/* JOIN the rows in standard input (instead of feeding them as events). They
+ * are sent by a child process, while this one prints the replies, so that
+ * neither side waits for the other with a full buffer.
+ */
+static void
+join(int sock)
+{
+	char *line = NULL;
+	size_t linesize = 0;
+	ssize_t linelen;
+	FILE *in;
+	pid_t pid;
+
+	write(sock, "JOIN\n", 5);
+
+	pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+
+	if (!pid) {
+		while ((linelen = getline(&line, &linesize, stdin)) >= 0)
+			write(sock, line, linelen);
+
+		write(sock, "\nEOF\n", 5);
+		exit(EXIT_SUCCESS);
+	}
+
+	in = fdopen(dup(sock), "r");
+	if (!in) {
+		perror("fdopen");
+		exit(EXIT_FAILURE);
+	}
+
+	while (getline(&line, &linesize, in) > 0) {
+		if (!strcmp(line, "# end\n"))
+			break;
+
+		if (strcmp(line, "# JOIN\n"))
+			fputs(line, stdout);
+	}
+
+	fclose(in);
+	free(line);
+	waitpid(pid, NULL, 0);
+}
+
+/* Send a query and print its reply. With a limit, the reply is asked for a
+ * page at a time, sending the query again with the token that ends each page
+ * until there are no more (the header of each page after the first is left
+ * out, so that it looks like a single reply).
+ */
+static void
+query(int sock, FILE *in, char *q, char *limit)
+{
+	char buf[BUFSIZ], *line = NULL, *token = NULL, *first = NULL;
+	size_t linesize = 0;
+	ssize_t ret;
+
+	if (!limit) {
+		write(sock, q, strlen(q));
+		ret = read(sock, buf, sizeof(buf));
+		fwrite(buf, 1, ret > 0 ? ret : 0, stdout);
+		return;
+	}
+
+	do {
+		int n = 0;
+
+		snprintf(buf, sizeof(buf), "%s LIMIT %s%s%s", q, limit,
+				token ? " AFTER " : "", token ? token : "");
+		free(token);
+		token = NULL;
+		write(sock, buf, strlen(buf));
+
+		while (getline(&line, &linesize, in) > 0) {
+			if (!strcmp(line, "# end\n"))
+				break;
+
+			if (!strncmp(line, "# next ", 7)) {
+				token = strdup(line + 7);
+				token[strcspn(token, "\n")] = '\0';
+				break;
+			}
+
+			if (!n++ && first && !strcmp(line, first))
+				continue;
+
+			if (!first)
+				first = strdup(line);
+
+			fputs(line, stdout);
+		}
+	} while (token);
+
+	free(first);
+	free(line);
 }
 
 /* The main function is the entry point to the application. In this case, it
@@ -87,18 +192,34 @@ main(int argc, char *argv[])
 	char buf[BUFSIZ];
 	char *line = NULL;
 	char *sockpath = "/tmp/it-sock";
+	char *dsname = NULL, *limit = NULL;
+	int batch = 0, joining = 0;
 	ssize_t linelen;
 	size_t linesize;
 	struct sockaddr_un addr;
+	FILE *in = NULL;
 	int sock;
+	ssize_t ret;
 	char c;
 
-	while ((c = getopt(argc, argv, "r:s:S:")) != -1) switch (c) {
+	while ((c = getopt(argc, argv, "bjl:r:s:S:n:")) != -1) switch (c) {
 		case 'r':
 		case 's': break;
 		case 'S':
 			  sockpath = optarg;
 			  break;
+		case 'n':
+			  dsname = optarg;
+			  break;
+		case 'b':
+			  batch = 1;
+			  break;
+		case 'l':
+			  limit = optarg;
+			  break;
+		case 'j':
+			  joining = 1;
+			  break;
 		default:
 			  usage(*argv);
 			  return 1;
@@ -123,43 +244,67 @@ main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	if (fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK) == -1) {
+	if (!joining && fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK) == -1) {
 		perror("Failed to set stdin to non-blocking");
 		return 1;
 	}
 
-	while ((linelen = getline(&line, &linesize, stdin)) >= 0)
+	if (dsname) {
+		snprintf(buf, sizeof(buf), "USE %s\n", dsname);
+		write(sock, buf, strlen(buf));
+	}
+
+	while (!joining && (linelen = getline(&line, &linesize, stdin)) >= 0)
 		write(sock, line, linelen);
 
 	write(sock, "EOF\n", 4);
 	free(line);
 
-	while ((c = getopt(argc, argv, "r:s:S:")) != -1) switch (c) {
+	if (joining)
+		join(sock);
+
+	if (limit) {
+		in = fdopen(dup(sock), "r");
+		if (!in) {
+			perror("fdopen");
+			return 1;
+		}
+	}
+
+	while ((c = getopt(argc, argv, "bjl:r:s:S:n:")) != -1) switch (c) {
 		case 'r':
 			strcpy(buf, "+ ");
 			strcat(buf, optarg);
-			write(sock, buf, strlen(buf));
-			read(sock, buf, sizeof(buf));
-			printf("%s", buf);
+			query(sock, in, buf, limit);
 			break;
 		case 's':
 			strcpy(buf, "* ");
 			strcat(buf, optarg);
-			write(sock, buf, strlen(buf));
-			read(sock, buf, sizeof(buf));
-			printf("%s", buf);
+			query(sock, in, buf, limit);
 			break;
+		case 'S':
+		case 'n':
+		case 'l':
+		case 'j':
+		case 'b': break;
 		default:
 			usage(*argv);
 			return 1;
 	}
 
-	while (optind < argc) {
-		char *arg = argv[optind++];
-		write(sock, arg, strlen(arg));
-		read(sock, buf, sizeof(buf));
-		printf("%s", buf);
+	if (batch && optind < argc) {
+		strcpy(buf, "BATCH");
+		while (optind < argc && strlen(buf) + strlen(argv[optind]) + 2 < sizeof(buf)) {
+			strcat(buf, " ");
+			strcat(buf, argv[optind++]);
+		}
+		write(sock, buf, strlen(buf));
+		ret = read(sock, buf, sizeof(buf));
+		fwrite(buf, 1, ret > 0 ? ret : 0, stdout);
 	}
 
+	while (optind < argc)
+		query(sock, in, argv[optind++], limit);
+
 	return EXIT_SUCCESS;
 }
@@ -48,13 +48,17 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 #ifdef __OpenBSD__
 #include <db4/db.h>
 #include <sys/queue.h>
@@ -97,18 +101,73 @@
 		} else
 
 #define USERNAME_MAX_LEN 32
+#define DS_NAME_MAX 32
+#define CONN_IN (BUFSIZ * 3) // input of a connection, that isn't a line yet
+#define CONN_OUT (1 << 18) // unsent output, after which input waits
+#define WATCH_BACKLOG (1 << 20) // unsent output a watcher can fall behind
+#define JOIN_CHUNK 4096 // rows of a JOIN that are answered together
 
 struct ti {
 	time_t min, max;
 	unsigned who;
 };
 
+/* hist chunks are keyed by person id and the start of their first interval */
+struct hist_key {
+	unsigned who;
+	time_t min;
+};
+
+struct hist_head {
+	unsigned count; // number of intervals in the chunk
+	time_t last; // latest end of an interval in the chunk (tinf if open)
+	time_t total; // seconds of presence in closed, bounded intervals
+};
+
+struct snap_head {
+	char magic[8];
+	uint32_t version;
+	uint32_t ti_size; // sizeof(struct ti)
+	uint32_t time_size; // sizeof(time_t)
+	uint32_t ids;
+	uint64_t count; // number of intervals
+	uint64_t size; // of the whole file
+	uint64_t names_off, name_off_off, by_name_off;
+	uint64_t by_max_off, min_suffix_off, by_id_off, id_start_off;
+};
+
+struct snap {
+	char *path;
+	void *base;
+	size_t size;
+	ino_t ino;
+	time_t mtime;
+	struct snap_head *head;
+	char *names;
+	uint64_t *name_off;
+	unsigned *by_name;
+	struct ti *by_max;
+	time_t *min_suffix;
+	struct ti *by_id;
+	uint64_t *id_start;
+};
+
 struct isplit {
 	time_t ts;
 	int max;
 	unsigned who;
 };
 
+struct probe {
+	time_t ts;
+	size_t pos; // where it was in the query
+};
+
+struct mt_ent {
+	struct ti ti;
+	int finish; // if set, this is the end of an interval open in the dbs
+};
+
 struct match {
 	struct ti ti;
 	STAILQ_ENTRY(match) entry;
@@ -119,30 +178,94 @@ STAILQ_HEAD(match_stailq, match);
 struct split {
 	time_t min;
 	time_t max;
-	DB *whodb;
+	uint64_t *who; // bitset of who is present
 	size_t count;
 	TAILQ_ENTRY(split) entry;
 };
 
 TAILQ_HEAD(split_tailq, split);
 
+/* what the planner knows about the intervals in the dbs (see plan_count) */
+struct plan_part {
+	time_t start;
+	unsigned long count; // intervals that end in it
+};
+
+struct plan_stats {
+	unsigned long *per_id; // intervals of each person
+	unsigned per_id_n;
+	struct plan_part *parts; // sorted by start
+	size_t parts_n;
+	unsigned long open, total;
+};
+
+enum plan_path {
+	PLAN_TIME, // through the max index
+	PLAN_ID, // through the intervals of each person
+};
+
+/* a plan, and the intervals each way would read */
+struct plan {
+	enum plan_path path;
+	unsigned long time_rows, id_rows;
+};
+
+#define PLAN_PART 86400
+
 struct tidbs {
 	DB *ti; // keys and values are struct ti
 	DB *max; // secondary DB (BTREE) with interval max as key
 	DB *id; // secondary DB (BTREE) with ids as primary key
-} pdbs;
+	DB *hist; // BTREE of per-id interval chunks (see hist_add)
+	struct mt_ent *mt; // changes not yet in the dbs (see mt_insert)
+	size_t mt_len;
+	time_t mt_time; // when the oldest change in the memtable was made
+	struct plan_stats stats; // see plan_count
+};
+
+struct compact_stats {
+	unsigned long ids; // people whose intervals were merged
+	unsigned long before, after; // their intervals before and after
+};
+
+/* A dataset is a set of people and their intervals, with dbs of its own.
+ * Many of them can live in the same file (and environment, so they share its
+ * cache), the names of their dbs prefixed by "NAME/". The default dataset has
+ * an empty name and no prefix, like files from before there were datasets.
+ * Connections work on the default one until they send "USE NAME".
+ */
+struct dataset {
+	char name[DS_NAME_MAX];
+	DB *gdb; // graph primary DB (keys are usernames, values are user ids)
+	DB *igdb; // secondary DB to lookup usernames via ids
+	unsigned g_len;
+	struct tidbs pdbs;
+	DB *rollup; // BTREE of struct rollup, by bucket (see rollup_get)
+	DB *grpdb; // group prefixes to their leader, in memory (see group_add)
+	unsigned *groups; // leaders of each id, GROUP_LEVELS of them
+	unsigned groups_n;
+	unsigned compact_next; // next person to compact in the background
+	struct compact_stats compact_bg; // what the background compaction did
+	SLIST_ENTRY(dataset) entry;
+};
+
+SLIST_HEAD(dataset_slist, dataset);
 
 enum pflags {
 	PF_DETACH = 1, // daemonize
 	PF_WAKE = 2, // don't shut down
 };
 
-DB *gdb = NULL; // graph primary DB (keys are usernames, values are user ids)
-DB *igdb = NULL; // secondary DB to lookup usernames via ids
+struct snap snap; // snap.base is only set if we are serving a snapshot
+
+struct dataset_slist datasets = SLIST_HEAD_INITIALIZER(datasets);
+struct dataset *ds = NULL; // the dataset being worked on
+struct dataset *ds_default = NULL;
+DB *dsdb = NULL; // names of the other datasets (keys only)
+static char *ds_fname = NULL;
 
 static DB_ENV *dbe = NULL;
 
-unsigned g_len = 0;
 unsigned g_notfound = (unsigned) -1;
 unsigned pflags = 0;
 
@@ -150,7 +273,21 @@ const time_t mtinf = (time_t) TS_MIN; // minus infinite
 const time_t tinf = (time_t) TS_MAX; // infinite
 
 static int srv_fd = -1;
-static fd_set fds_read, fds_active, fds_write;
+static fd_set fds_read, fds_active, fds_write, fds_pending;
+
+struct conn {
+	struct dataset *ds; // see USE
+	char *in, *out; // what was read but not processed, and the other way
+	size_t in_len, out_len;
+	int query, eof; // it sent "EOF", it closed its end
+	char *watch; // the ids it WATCHes (NULL if it doesn't)
+	struct dataset *wds; // and where
+	struct tz *wtz; // and in what zone
+	struct join *join; // see JOIN
+} conns[FD_SETSIZE];
+
+static struct conn *qconn; // of the query being processed
+static unsigned watchers;
 
 void sig_shutdown(int i)
 {
@@ -158,9 +295,375 @@ void sig_shutdown(int i)
 	pflags &= ~PF_WAKE;
 }
 
-/* get timestamp from ISO-8601 date string */
+/******
+ * timezone related functions
+ ******/
+
+/* Offsets of an IANA zone: from at[i] on, local time is UTC + off[i]
+ * seconds (off0 before at[0]). They are read once from its tzdata file, and
+ * the changes of the POSIX rule at the end of it are written out until
+ * TZ_YEAR_MAX too, so that converting a time is a binary search and some
+ * integer arithmetic, whatever the TZ of the daemon is.
+ */
+struct tz {
+	char name[64];
+	time_t *at;
+	long *off;
+	size_t len;
+	long off0;
+	SLIST_ENTRY(tz) entry;
+};
+
+/* a rule of a POSIX TZ string, like "M3.5.0/2" */
+struct tz_rule {
+	char kind; // 'M' (month, week, day), 'J' (julian day) or 'n' (day)
+	int m, w, d;
+	long secs; // local time of the change
+};
+
+#define TZ_DIR "/usr/share/zoneinfo"
+#define TZ_YEAR_MAX 2200
+
+SLIST_HEAD(tz_slist, tz);
+struct tz_slist zones = SLIST_HEAD_INITIALIZER(zones);
+static struct tz *qtz; // zone of the query being processed (TZ), or NULL
+
+/* days from 1970-01-01 to a date (proleptic gregorian calendar) */
+static long
+days_civil(long y, unsigned m, unsigned d)
+{
+	unsigned yoe, doy;
+	long era;
+
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = (unsigned) (y - era * 400);
+	doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+/* local time of the change of a rule in a year */
 static time_t
-sscantime(char *buf)
+tz_rule_at(struct tz_rule *r, long y)
+{
+	int leap = (y % 4 == 0 && y % 100) || y % 400 == 0;
+	long day, first, mdays;
+	int wday;
+
+	switch (r->kind) {
+	case 'J':
+		day = days_civil(y, 1, 1) + r->d - 1 + (leap && r->d >= 60);
+		break;
+	case 'n':
+		day = days_civil(y, 1, 1) + r->d;
+		break;
+	default:
+		first = days_civil(y, r->m, 1);
+		mdays = days_civil(y + (r->m == 12), r->m % 12 + 1, 1) - first;
+		wday = (int) ((first % 7 + 11) % 7); // 1970-01-01 was a thursday
+		day = (r->d - wday + 7) % 7 + (r->w - 1) * 7;
+		while (day >= mdays)
+			day -= 7;
+		day += first;
+	}
+
+	return (time_t) day * 86400 + r->secs;
+}
+
+/* skip a zone abbreviation of a POSIX TZ string */
+static char *
+tz_pname(char *s)
+{
+	if (*s == '<')
+		return (s = strchr(s, '>')) ? s + 1 : NULL;
+
+	for (; isalpha(*s); s++);
+	return s;
+}
+
+/* read a [+-]hh[:mm[:ss]] of a POSIX TZ string */
+static char *
+tz_phms(char *s, long *secs)
+{
+	long sign = 1, mul = 3600;
+
+	if (*s == '+' || *s == '-')
+		sign = *s++ == '-' ? -1 : 1;
+
+	if (!isdigit(*s))
+		return NULL;
+
+	for (*secs = 0;; s++) {
+		*secs += strtol(s, &s, 10) * mul;
+		mul /= 60;
+		if (!mul || *s != ':' || !isdigit(s[1]))
+			break;
+	}
+
+	*secs *= sign;
+	return s;
+}
+
+/* read a rule of a POSIX TZ string: Mm.w.d, Jn or n, then [/time] */
+static char *
+tz_prule(char *s, struct tz_rule *r)
+{
+	r->secs = 7200;
+
+	if (*s == 'M') {
+		r->kind = 'M';
+		r->m = (int) strtol(s + 1, &s, 10);
+		if (*s++ != '.')
+			return NULL;
+		r->w = (int) strtol(s, &s, 10);
+		if (*s++ != '.')
+			return NULL;
+		r->d = (int) strtol(s, &s, 10);
+		if (r->m < 1 || r->m > 12 || r->w < 1 || r->w > 5
+				|| r->d < 0 || r->d > 6)
+			return NULL;
+	} else {
+		r->kind = *s == 'J' ? *s++ : 'n';
+		if (!isdigit(*s))
+			return NULL;
+		r->d = (int) strtol(s, &s, 10);
+		if (r->d > 365 || (r->kind == 'J' && !r->d))
+			return NULL;
+	}
+
+	if (*s == '/')
+		return tz_phms(s + 1, &r->secs);
+
+	return s;
+}
+
+static void
+tz_push(struct tz *tz, time_t at, long off)
+{
+	tz->at = (time_t *) realloc(tz->at, sizeof(time_t) * (tz->len + 1));
+	tz->off = (long *) realloc(tz->off, sizeof(long) * (tz->len + 1));
+	tz->at[tz->len] = at;
+	tz->off[tz->len++] = off;
+}
+
+/* Adds the changes of a POSIX TZ string (like "CET-1CEST,M3.5.0,M10.5.0/3")
+ * that come after the last transition of the file, until TZ_YEAR_MAX.
+ * Note that its offsets are west of UTC, and ours east.
+ */
+static int
+tz_posix(struct tz *tz, char *s)
+{
+	struct tz_rule start, end;
+	time_t after = tz->len ? tz->at[tz->len - 1] : mtinf, a, b;
+	long std, dst, y = 1970;
+	struct tm tm;
+
+	if (!(s = tz_pname(s)) || !(s = tz_phms(s, &std)))
+		return -1;
+
+	std = -std;
+	if (!*s) {
+		if (!tz->len)
+			tz->off0 = std;
+		return 0;
+	}
+
+	if (!(s = tz_pname(s)))
+		return -1;
+
+	dst = std + 3600;
+	if (*s != ',') {
+		if (!(s = tz_phms(s, &dst)))
+			return -1;
+		dst = -dst;
+	}
+
+	if (*s++ != ',' || !(s = tz_prule(s, &start))
+			|| *s++ != ',' || !(s = tz_prule(s, &end)) || *s)
+		return -1;
+
+	if (tz->len && gmtime_r(&after, &tm))
+		y = tm.tm_year + 1900L;
+
+	for (; y <= TZ_YEAR_MAX; y++) {
+		a = tz_rule_at(&start, y) - std;
+		b = tz_rule_at(&end, y) - dst;
+
+		if (a < b) {
+			if (a > after)
+				tz_push(tz, a, dst);
+			if (b > after)
+				tz_push(tz, b, std);
+		} else {
+			if (b > after)
+				tz_push(tz, b, std);
+			if (a > after)
+				tz_push(tz, a, dst);
+		}
+	}
+
+	return 0;
+}
+
+static int32_t
+tz_be32(unsigned char *p)
+{
+	return (int32_t) ((uint32_t) p[0] << 24 | (uint32_t) p[1] << 16
+			| (uint32_t) p[2] << 8 | p[3]);
+}
+
+/* Reads a TZif file (RFC 8536). Of version 2 and later, only the 64-bit
+ * part and the POSIX TZ string after it are used.
+ */
+static int
+tz_parse(struct tz *tz, unsigned char *p, size_t size)
+{
+	unsigned char *end = p + size, *idx, *types, *foot;
+	uint32_t isut, isstd, leap, timecnt, typecnt, charcnt, i;
+	size_t tsize = 4, dlen;
+	int version;
+
+	if (size < 44 || memcmp(p, "TZif", 4))
+		return -1;
+
+	version = p[4];
+
+again:
+	isut = tz_be32(p + 20);
+	isstd = tz_be32(p + 24);
+	leap = tz_be32(p + 28);
+	timecnt = tz_be32(p + 32);
+	typecnt = tz_be32(p + 36);
+	charcnt = tz_be32(p + 40);
+	p += 44;
+
+	dlen = (size_t) timecnt * (tsize + 1) + typecnt * 6 + charcnt
+		+ (size_t) leap * (tsize + 4) + isstd + isut;
+
+	if (!typecnt || dlen > (size_t) (end - p))
+		return -1;
+
+	if (version && tsize == 4) {
+		p += dlen;
+		tsize = 8;
+		if (end - p < 44 || memcmp(p, "TZif", 4))
+			return -1;
+		goto again;
+	}
+
+	idx = p + timecnt * tsize;
+	types = idx + timecnt;
+	tz->off0 = tz_be32(types);
+
+	for (i = 0; i < timecnt; i++, p += tsize) {
+		time_t at = tsize == 8
+			? (time_t) ((uint64_t) tz_be32(p) << 32 | (uint32_t) tz_be32(p + 4))
+			: tz_be32(p);
+
+		if (idx[i] >= typecnt)
+			return -1;
+
+		tz_push(tz, at, tz_be32(types + 6 * idx[i]));
+	}
+
+	p += dlen - timecnt * tsize;
+	if (tsize == 4 || p >= end || *p != '\n'
+			|| !(foot = memchr(p + 1, '\n', end - p - 1)))
+		return 0;
+
+	*foot = '\0';
+	return tz_posix(tz, (char *) p + 1);
+}
+
+/* Gets a zone by its name (like "Europe/Lisbon"), loading it the first
+ * time. Returns NULL if there is no such zone.
+ */
+static struct tz *
+tz_get(char *name)
+{
+	char path[sizeof(TZ_DIR) + sizeof(((struct tz *) 0)->name)];
+	unsigned char *buf;
+	struct tz *tz;
+	struct stat st;
+	int fd, ret;
+
+	SLIST_FOREACH(tz, &zones, entry)
+		if (!strcmp(tz->name, name))
+			return tz;
+
+	if (!*name || *name == '/' || strstr(name, "..")
+			|| strlen(name) >= sizeof(tz->name))
+		return NULL;
+
+	snprintf(path, sizeof(path), "%s/%s", TZ_DIR, name);
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return NULL;
+	}
+
+	buf = (unsigned char *) malloc(st.st_size + 1);
+	ret = read(fd, buf, st.st_size) != st.st_size;
+	close(fd);
+
+	tz = (struct tz *) calloc(1, sizeof(struct tz));
+	if (ret || tz_parse(tz, buf, st.st_size)) {
+		free(tz->at);
+		free(tz->off);
+		free(tz);
+		free(buf);
+		return NULL;
+	}
+
+	free(buf);
+	strcpy(tz->name, name);
+	SLIST_INSERT_HEAD(&zones, tz, entry);
+	return tz;
+}
+
+/* offset of local time from UTC, in seconds, at t */
+static long
+tz_offset(struct tz *tz, time_t t)
+{
+	size_t lo = 0, hi = tz->len, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (tz->at[mid] <= t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo ? tz->off[lo - 1] : tz->off0;
+}
+
+/* UTC time of a local time, given as if it was UTC. Local times that a
+ * change skips or repeats get one of the times around it.
+ */
+static time_t
+tz_utc(struct tz *tz, time_t local)
+{
+	return local - tz_offset(tz, local - tz_offset(tz, local));
+}
+
+/* The time STEP after t. With a zone (TZ), whole days are days of its
+ * calendar, so a day can be 23 or 25 hours long, and it stays at midnight.
+ */
+static time_t
+tz_add(time_t t, time_t step)
+{
+	if (!qtz || step % 86400)
+		return t + step;
+
+	return tz_utc(qtz, t + tz_offset(qtz, t) + step);
+}
+
+/* get timestamp from ISO-8601 date string, returns -1 if it isn't one */
+static int
+read_time(time_t *ts, char *buf)
 {
 	char *aux;
 	struct tm tm;
@@ -169,25 +672,87 @@ sscantime(char *buf)
 	aux = strptime(buf, "%Y-%m-%dT%H:%M:%S", &tm);
 	if (!aux && !strptime(buf, "%Y-%m-%d", &tm)) {
 		char *endptr;
-		unsigned long long int timestamp = strtoull(buf, &endptr, 10);
-		if (errno == 0 && *endptr == '\0' && buf != endptr)
-			return (time_t)timestamp;
-		else
-			err(EXIT_FAILURE, "Invalid date or timestamp");
+		unsigned long long int timestamp;
+
+		errno = 0;
+		timestamp = strtoull(buf, &endptr, 10);
+		if (errno || *endptr != '\0' || buf == endptr)
+			return -1;
+
+		*ts = (time_t) timestamp;
+		return 0;
+	}
+
+	if (qtz)
+		*ts = tz_utc(qtz, timegm(&tm));
+	else {
+		tm.tm_isdst = -1;
+		*ts = mktime(&tm);
 	}
 
-	tm.tm_isdst = -1;
-	return mktime(&tm);
+	return 0;
 }
 
-/* get ISO-8601 date string from timestamp
- *
- * only use this for debug (memory leak), or free pointer
+/* the same, where an invalid one is fatal */
+static time_t
+sscantime(char *buf)
+{
+	time_t ts;
+
+	if (read_time(&ts, buf))
+		err(EXIT_FAILURE, "Invalid date or timestamp");
+
+	return ts;
+}
+
+/* get a number of seconds from a duration such as "90", "15m" or "400d",
+ * or -1 if it isn't one
+ */
+static time_t
+read_duration(char *buf)
+{
+	char *endptr;
+	long long n;
+
+	errno = 0;
+	n = strtoll(buf, &endptr, 10);
+	if (errno || buf == endptr || n < 0)
+		return -1;
+
+	switch (*endptr) {
+	case 'w': n *= 7;
+	case 'd': n *= 24;
+	case 'h': n *= 60;
+	case 'm': n *= 60;
+	case 's':
+		endptr++;
+	case '\0':
+		break;
+	default:
+		return -1;
+	}
+
+	return *endptr ? -1 : (time_t) n;
+}
+
+/* the same, for the command line, where an invalid one is fatal */
+static time_t
+sscanduration(char *buf)
+{
+	time_t n = read_duration(buf);
+
+	if (n < 0)
+		errx(EXIT_FAILURE, "Invalid duration: %s", buf);
+
+	return n;
+}
+
+/* get ISO-8601 date string from timestamp, into a buffer of at least
+ * DATE_MAX_LEN bytes (infinities are returned as constant strings)
  */
 static char *
-printtime(time_t ts)
+printtime_r(char *buf, time_t ts)
 {
-	char *buf;
 	struct tm tm;
 
 	if (ts == mtinf)
@@ -196,8 +761,12 @@ printtime(time_t ts)
 	if (ts == tinf)
 		return "inf";
 
-	buf = (char *) malloc(DATE_MAX_LEN);
-	tm = *localtime(&ts);
+	if (qtz) {
+		time_t local = ts + tz_offset(qtz, ts);
+
+		gmtime_r(&local, &tm);
+	} else
+		tm = *localtime(&ts);
 
 	if (tm.tm_sec || tm.tm_min || tm.tm_hour)
 		strftime(buf, DATE_MAX_LEN, "%FT%T", &tm);
@@ -207,6 +776,16 @@ printtime(time_t ts)
 	return buf;
 }
 
+/* get ISO-8601 date string from timestamp
+ *
+ * only use this for debug (memory leak), or free pointer
+ */
+static char *
+printtime(time_t ts)
+{
+	return printtime_r((char *) malloc(DATE_MAX_LEN), ts);
+}
+
 /* read a word */
 static size_t
 read_word(char *buf, char *input, size_t max_len)
@@ -226,6 +805,14 @@ read_word(char *buf, char *input, size_t max_len)
 	return ret;
 }
 
+/* check if there is nothing left to read in a line */
+static int
+line_empty(char *line)
+{
+	for (; *line && isspace(*line); line++);
+	return !*line;
+}
+
 /* read date in iso 8601 and convert it to a unix timestamp */
 static size_t
 read_ts(time_t *target, char *line)
@@ -233,26 +820,22 @@ read_ts(time_t *target, char *line)
 	char date_str[DATE_MAX_LEN];
 	size_t ret;
 
-	ret = read_word(date_str, line, sizeof(date_str));
+	ret = read_word(date_str, line, sizeof(date_str) - 1);
 	*target = sscantime(date_str);
 
 	return ret;
 }
 
+/* the same, where an invalid date isn't fatal: it advances *line past it,
+ * returning -1 if it isn't one
+ */
 static int
-who_init(DB **whodb) {
-	return db_create(whodb, dbe, 0) \
-		|| gdb->open(*whodb, NULL, NULL, NULL, DB_HASH, DB_CREATE, 0664);
-}
-
-/* insert a list of present people into a split */
-static int
-who_count(DB *whodb)
+read_date(time_t *target, char **line)
 {
-	int len = 0;
-	DB_ITER(whodb)
-		len++;
-	return len;
+	char date_str[DATE_MAX_LEN];
+
+	*line += read_word(date_str, *line, sizeof(date_str) - 1);
+	return read_time(target, date_str);
 }
 
 /******
@@ -260,6 +843,21 @@ who_count(DB *whodb)
  ******/
 
 static unsigned g_find(char *name);
+static void hist_rebuild(struct tidbs *dbs);
+static unsigned snap_find(char *name);
+static void mt_flush(struct tidbs *dbs);
+static void rollup_invalidate(time_t min, time_t max);
+static void group_add(unsigned id, char *name);
+static void groups_init(void);
+static void groups_free(void);
+static void plan_init(struct tidbs *dbs);
+static void watch_notify(char sign, time_t ts, unsigned id);
+static void join_free(struct join *join);
+static void plan_free(struct tidbs *dbs);
+static time_t mt_end(struct tidbs *dbs, unsigned who, time_t min);
+static int mt_present(struct tidbs *dbs, time_t when, unsigned who);
+static unsigned mt_intersect(struct tidbs *dbs, struct match_stailq *matches,
+		time_t min, time_t max, uint64_t *ids);
 
 /* read id and convert it to existing numeric id */
 static size_t
@@ -339,82 +937,356 @@ tiid_cmp(DB *sec, const DBT *a_r, const DBT *b_r)
 	return b > a ? -1 : (a > b ? 1 : 0);
 }
 
+/* compare two hist chunk keys (for sorting BST items) */
+static int
+#ifdef __APPLE__
+hist_cmp(DB *sec, const DBT *a_r, const DBT *b_r, size_t *locp)
+#else
+hist_cmp(DB *sec, const DBT *a_r, const DBT *b_r)
+#endif
+{
+	struct hist_key a, b;
+	memcpy(&a, a_r->data, sizeof(a));
+	memcpy(&b, b_r->data, sizeof(b));
+	if (a.who != b.who)
+		return b.who > a.who ? -1 : 1;
+	return b.min > a.min ? -1 : (a.min > b.min ? 1 : 0);
+}
+
 /******
  * Database initializers
  ******/
 
-/* initialize ti dbs */
+/* get the name of a db of the current dataset into buf */
+static char *
+ds_dbname(char *buf, char *name)
+{
+	if (*ds->name)
+		snprintf(buf, DS_NAME_MAX * 2, "%s/%s", ds->name, name);
+	else
+		strcpy(buf, name);
+	return buf;
+}
+
+/* initialize ti dbs (of the current dataset) */
 static int
 tidbs_init(struct tidbs *dbs, char *fname)
 {
+	char ti[DS_NAME_MAX * 2], max[DS_NAME_MAX * 2],
+	     id[DS_NAME_MAX * 2], hist[DS_NAME_MAX * 2];
+
+	ds_dbname(ti, "ti");
+	ds_dbname(max, "max");
+	ds_dbname(id, "id");
+	ds_dbname(hist, "hist");
+
 	return db_create(&dbs->ti, dbe, 0)
-		|| dbs->ti->open(dbs->ti, NULL, fname, "ti", DB_HASH, DB_CREATE, 0664)
+		|| dbs->ti->open(dbs->ti, NULL, fname, ti, DB_HASH, DB_CREATE, 0664)
 
 		|| db_create(&dbs->max, dbe, 0)
 		|| dbs->max->set_bt_compare(dbs->max, timax_cmp)
 		|| dbs->max->set_flags(dbs->max, DB_DUP)
-		|| dbs->max->open(dbs->max, NULL, fname, "max", DB_BTREE, DB_CREATE, 0664)
+		|| dbs->max->open(dbs->max, NULL, fname, max, DB_BTREE, DB_CREATE, 0664)
 		|| dbs->ti->associate(dbs->ti, NULL, dbs->max, map_tidb_timaxdb, DB_CREATE | DB_IMMUTABLE_KEY)
 
 		|| db_create(&dbs->id, dbe, 0)
 		|| dbs->id->set_bt_compare(dbs->id, tiid_cmp)
 		|| dbs->id->set_flags(dbs->id, DB_DUP)
-		|| dbs->id->open(dbs->id, NULL, fname, "id", DB_BTREE, DB_CREATE, 0664)
-		|| dbs->ti->associate(dbs->ti, NULL, dbs->id, map_tidb_tiiddb, DB_CREATE | DB_IMMUTABLE_KEY);
+		|| dbs->id->open(dbs->id, NULL, fname, id, DB_BTREE, DB_CREATE, 0664)
+		|| dbs->ti->associate(dbs->ti, NULL, dbs->id, map_tidb_tiiddb, DB_CREATE | DB_IMMUTABLE_KEY)
+
+		|| db_create(&dbs->hist, dbe, 0)
+		|| dbs->hist->set_bt_compare(dbs->hist, hist_cmp)
+		|| dbs->hist->open(dbs->hist, NULL, fname, hist, DB_BTREE, DB_CREATE, 0664);
 }
 
-/* Initialize all dbs */
+/* Initialize all dbs of the current dataset */
 static void
 dbs_init(char *fname)
 {
-	int ret = db_create(&gdb, dbe, 0)
-		|| gdb->open(gdb, NULL, fname, "g", DB_HASH, DB_CREATE, 0664)
+	char g[DS_NAME_MAX * 2], ig[DS_NAME_MAX * 2], rollup[DS_NAME_MAX * 2];
+	int ret = db_create(&ds->gdb, dbe, 0)
+		|| ds->gdb->open(ds->gdb, NULL, fname, ds_dbname(g, "g"), DB_HASH, DB_CREATE, 0664)
 
-		|| db_create(&igdb, dbe, 0)
-		|| igdb->open(igdb, NULL, fname, "ig", DB_HASH, DB_CREATE, 0664)
-		|| gdb->associate(gdb, NULL, igdb, map_gdb_igdb, DB_CREATE)
+		|| db_create(&ds->igdb, dbe, 0)
+		|| ds->igdb->open(ds->igdb, NULL, fname, ds_dbname(ig, "ig"), DB_HASH, DB_CREATE, 0664)
+		|| ds->gdb->associate(ds->gdb, NULL, ds->igdb, map_gdb_igdb, DB_CREATE)
 
-		|| tidbs_init(&pdbs, fname);
+		|| tidbs_init(&ds->pdbs, fname)
+
+		|| db_create(&ds->rollup, dbe, 0)
+		|| ds->rollup->set_bt_compare(ds->rollup, timax_cmp)
+		|| ds->rollup->open(ds->rollup, NULL, fname, ds_dbname(rollup, "rollup"), DB_BTREE, DB_CREATE, 0664);
 
 	CBUG(ret);
+	hist_rebuild(&ds->pdbs);
+	plan_init(&ds->pdbs);
+
+	// ids are sequential, so we continue from the last one
+	{
+		DB_ITER(ds->gdb) {
+			unsigned id;
+			memcpy(&id, data.data, sizeof(id));
+			if (id >= ds->g_len)
+				ds->g_len = id + 1;
+		}
+	}
+	groups_init();
+}
+
+/* close all dbs of the current dataset */
+static void
+dbs_close(void)
+{
+	mt_flush(&ds->pdbs);
+	CBUG(ds->pdbs.max->close(ds->pdbs.max, 0));
+	CBUG(ds->pdbs.id->close(ds->pdbs.id, 0));
+	CBUG(ds->pdbs.ti->close(ds->pdbs.ti, 0));
+	CBUG(ds->pdbs.hist->close(ds->pdbs.hist, 0));
+	plan_free(&ds->pdbs);
+	CBUG(ds->rollup->close(ds->rollup, 0));
+	groups_free();
+	CBUG(ds->igdb->close(ds->igdb, 0));
+	CBUG(ds->gdb->close(ds->gdb, 0));
 }
 
 /******
- * g (usernames to user ids) related functions
+ * dataset related functions
  ******/
 
-/* insert new person id (auto-generated) */
-unsigned
-g_insert(char *name)
+/* check if a dataset name is something we can put in db names */
+static int
+ds_valid(char *name)
 {
-	DBT key, data;
+	size_t len = strlen(name);
 
-	memset(&key, 0, sizeof(DBT));
-	memset(&data, 0, sizeof(DBT));
+	if (len >= DS_NAME_MAX)
+		return 0;
 
-	key.data = name;
-	key.size = strlen(name) + 1;
-	data.data = &g_len;
-	data.size = sizeof(g_len);
+	for (; *name; name++)
+		if (!isalnum(*name) && !strchr("_-.", *name))
+			return 0;
 
-	CBUG(gdb->put(gdb, NULL, &key, &data, 0));
-	return g_len++;
+	return 1;
 }
 
-/* find existing person id from their nickname */
-static unsigned
-g_find(char *name)
+/* make a dataset the current one, opening (or creating) its dbs if needed.
+ * Returns NULL if the name isn't valid
+ */
+static struct dataset *
+ds_use(char *name)
 {
+	struct dataset *d;
 	DBT key, data;
-	int ret;
 
-	memset(&key, 0, sizeof(DBT));
-	memset(&data, 0, sizeof(DBT));
+	if (!ds_valid(name))
+		return NULL;
 
-	key.data = name;
+	SLIST_FOREACH(d, &datasets, entry)
+		if (!strcmp(d->name, name))
+			return ds = d;
+
+	d = (struct dataset *) calloc(1, sizeof(struct dataset));
+	strcpy(d->name, name);
+	ds = d;
+	dbs_init(ds_fname);
+	SLIST_INSERT_HEAD(&datasets, d, entry);
+
+	if (!*name)
+		return d;
+
+	memset(&key, 0, sizeof(DBT));
+	memset(&data, 0, sizeof(DBT));
+	key.data = name;
+	key.size = strlen(name) + 1;
+	CBUG(dsdb->put(dsdb, NULL, &key, &data, 0));
+	return d;
+}
+
+/* open the default dataset and all the others that are in the file, so that
+ * background work reaches them even if nobody uses them
+ */
+static void
+ds_init(char *fname)
+{
+	ds_fname = fname;
+
+	CBUG(db_create(&dsdb, dbe, 0)
+		|| dsdb->open(dsdb, NULL, fname, "ds", DB_HASH, DB_CREATE, 0664));
+
+	ds_default = ds_use("");
+
+	{
+		// not opened right away, since that writes to dsdb
+		char (*names)[DS_NAME_MAX] = NULL;
+		size_t n = 0, i;
+
+		DB_ITER(dsdb) {
+			names = realloc(names, sizeof(*names) * (n + 1));
+			strncpy(names[n++], key.data, DS_NAME_MAX - 1);
+			names[n - 1][DS_NAME_MAX - 1] = '\0';
+		}
+
+		for (i = 0; i < n; i++)
+			ds_use(names[i]);
+
+		free(names);
+	}
+
+	ds = ds_default;
+}
+
+/******
+ * result cache related functions
+ ******/
+
+/* Many clients keep asking the same range queries (yesterday, this week),
+ * so their replies are kept, least recently used first out. Each one knows
+ * the range of time it is about, and is only dropped when a change touches
+ * an interval that overlaps it (see rcache_invalidate), so replies about
+ * ranges that are long closed stay for as long as they're asked for.
+ */
+
+#define RCACHE_REPLY_MAX (1 << 20) // bigger replies aren't kept
+
+struct rcache_ent {
+	struct dataset *ds;
+	char *query;
+	time_t min, max;
+	char *reply;
+	size_t len;
+	TAILQ_ENTRY(rcache_ent) entry;
+};
+
+TAILQ_HEAD(rcache_tailq, rcache_ent);
+
+struct rcache_tailq rcache = TAILQ_HEAD_INITIALIZER(rcache);
+unsigned rcache_max = 256, rcache_len = 0;
+
+struct {
+	unsigned long hits, misses, invalidated;
+	size_t bytes;
+} rcache_st;
+
+static void
+rcache_remove(struct rcache_ent *ent)
+{
+	TAILQ_REMOVE(&rcache, ent, entry);
+	rcache_len--;
+	rcache_st.bytes -= ent->len;
+	free(ent->query);
+	free(ent->reply);
+	free(ent);
+}
+
+/* find the reply to a query, making it the most recently used */
+static struct rcache_ent *
+rcache_get(char *query)
+{
+	struct rcache_ent *ent;
+
+	TAILQ_FOREACH(ent, &rcache, entry)
+		if (ent->ds == ds && !strcmp(ent->query, query)) {
+			TAILQ_REMOVE(&rcache, ent, entry);
+			TAILQ_INSERT_HEAD(&rcache, ent, entry);
+			rcache_st.hits++;
+			return ent;
+		}
+
+	rcache_st.misses++;
+	return NULL;
+}
+
+/* keep the reply to a query about [min, max] */
+static void
+rcache_put(char *query, time_t min, time_t max, char *reply, size_t len)
+{
+	struct rcache_ent *ent;
+
+	if (!rcache_max || len > RCACHE_REPLY_MAX)
+		return;
+
+	if (rcache_len >= rcache_max)
+		rcache_remove(TAILQ_LAST(&rcache, rcache_tailq));
+
+	ent = (struct rcache_ent *) malloc(sizeof(struct rcache_ent));
+	ent->ds = ds;
+	ent->query = strdup(query);
+	ent->min = min;
+	ent->max = max;
+	ent->reply = (char *) malloc(len);
+	memcpy(ent->reply, reply, len);
+	ent->len = len;
+	TAILQ_INSERT_HEAD(&rcache, ent, entry);
+	rcache_len++;
+	rcache_st.bytes += len;
+}
+
+/* drop the replies of the current dataset that might have changed, because
+ * an interval overlapping [min, max] did (or all of them, with NULL ds)
+ */
+static void
+rcache_invalidate(struct dataset *d, time_t min, time_t max)
+{
+	struct rcache_ent *ent, *tmp;
+
+	TAILQ_FOREACH_SAFE(ent, &rcache, entry, tmp)
+		if (!d || (ent->ds == d && ent->min <= max && min <= ent->max)) {
+			rcache_remove(ent);
+			rcache_st.invalidated++;
+		}
+}
+
+static void
+rcache_print(FILE *out)
+{
+	fprintf(out, "entries %u max %u bytes %zu\n",
+			rcache_len, rcache_max, rcache_st.bytes);
+	fprintf(out, "hits %lu misses %lu invalidated %lu\n",
+			rcache_st.hits, rcache_st.misses,
+			rcache_st.invalidated);
+}
+
+/******
+ * g (usernames to user ids) related functions
+ ******/
+
+/* insert new person id (auto-generated) */
+unsigned
+g_insert(char *name)
+{
+	DBT key, data;
+
+	memset(&key, 0, sizeof(DBT));
+	memset(&data, 0, sizeof(DBT));
+
+	key.data = name;
+	key.size = strlen(name) + 1;
+	data.data = &ds->g_len;
+	data.size = sizeof(ds->g_len);
+
+	CBUG(ds->gdb->put(ds->gdb, NULL, &key, &data, 0));
+	group_add(ds->g_len, name);
+	return ds->g_len++;
+}
+
+/* find existing person id from their nickname */
+static unsigned
+g_find(char *name)
+{
+	DBT key, data;
+	int ret;
+
+	if (snap.base)
+		return snap_find(name);
+
+	memset(&key, 0, sizeof(DBT));
+	memset(&data, 0, sizeof(DBT));
+
+	key.data = name;
 	key.size = strlen(name) + 1;
 
-	ret = gdb->get(gdb, NULL, &key, &data, 0);
+	ret = ds->gdb->get(ds->gdb, NULL, &key, &data, 0);
 
 	if (ret == DB_NOTFOUND)
 		return g_notfound;
@@ -436,6 +1308,9 @@ gi_get(unsigned id)
 {
 	DBT key, pkey, data;
 
+	if (snap.base)
+		return snap.names + snap.name_off[id];
+
 	memset(&key, 0, sizeof(DBT));
 	memset(&pkey, 0, sizeof(DBT));
 	memset(&data, 0, sizeof(DBT));
@@ -443,736 +1318,4974 @@ gi_get(unsigned id)
 	key.data = &id;
 	key.size = sizeof(id);;
 
-	CBUG(igdb->pget(igdb, NULL, &key, &pkey, &data, 0));
+	CBUG(ds->igdb->pget(ds->igdb, NULL, &key, &pkey, &data, 0));
 	return pkey.data;
 }
 
 /******
- * who (db of "current" people, for use in split calculation) related functions
+ * bitset (sets of people, for use in split calculation) related functions
  ******/
 
-/* drop the db of present people */
-static void
-who_drop(DB *whodb)
-{
-	DBC *cur;
-	DBT key, data;
-	int res;
-
-	CBUG(whodb->cursor(whodb, NULL, &cur, 0));
+/* Sets of people are kept as one bit per id, so that unions, intersections
+ * and counts go through a machine word of ids at a time, in loops that are
+ * simple enough for compilers to vectorize.
+ */
 
-	memset(&key, 0, sizeof(DBT));
-	memset(&data, 0, sizeof(DBT));
+#define BS_BITS 64
 
-	while (1) {
-		res = cur->c_get(cur, &key, &data, DB_NEXT);
+/* how many person ids there can be */
+static inline unsigned
+ids_len(void)
+{
+	return snap.base ? snap.head->ids : ds->g_len;
+}
 
-		if (res == DB_NOTFOUND)
-			break;
+/* how many words the bitsets of the current dataset have */
+static inline size_t
+bs_len(void)
+{
+	return (ids_len() + BS_BITS - 1) / BS_BITS;
+}
 
-		CBUG(res);
-		CBUG(cur->c_del(cur, 0));
-	}
+static inline uint64_t *
+bs_create(void)
+{
+	return (uint64_t *) calloc(bs_len() + 1, sizeof(uint64_t));
+}
 
-	CBUG(cur->close(cur));
+static inline void
+bs_set(uint64_t *bs, unsigned who)
+{
+	bs[who / BS_BITS] |= 1ULL << (who % BS_BITS);
 }
 
-/* put a person in the db of present people */
-static void
-who_insert(DB *whodb, unsigned who)
+static inline int
+bs_test(uint64_t *bs, unsigned who)
 {
-	DBT key, data;
+	return (bs[who / BS_BITS] >> (who % BS_BITS)) & 1;
+}
 
-	memset(&key, 0, sizeof(DBT));
-	memset(&data, 0, sizeof(DBT));
+static inline void
+bs_clear(uint64_t *bs, unsigned who)
+{
+	bs[who / BS_BITS] &= ~(1ULL << (who % BS_BITS));
+}
 
-	key.data = &who;
-	key.size = sizeof(who);
-	data.data = NULL;
-	data.size = 0;
+static inline void
+bs_or(uint64_t *dst, uint64_t *src, size_t n)
+{
+	size_t i;
 
-	CBUG(whodb->put(whodb, NULL, &key, &data, 0));
+	for (i = 0; i < n; i++)
+		dst[i] |= src[i];
 }
 
-/* remove a person from the db of present people */
-static int
-who_remove(DB *whodb, unsigned who) {
-	DBT key;
+static inline void
+bs_and(uint64_t *dst, uint64_t *src, size_t n)
+{
+	size_t i;
 
-	memset(&key, 0, sizeof(DBT));
+	for (i = 0; i < n; i++)
+		dst[i] &= src[i];
+}
 
-	key.data = &who;
-	key.size = sizeof(who);
+static inline size_t
+bs_count(uint64_t *bs, size_t n)
+{
+	size_t i, count = 0;
+
+	for (i = 0; i < n; i++)
+		count += __builtin_popcountll(bs[i]);
 
-	CBUG(whodb->del(whodb, NULL, &key, 0));
+	return count;
 }
 
-static int
-who_get(DB *whodb, unsigned who) {
-	DBT key, data;
+/* the first id in the set that is at least from, or -1 if there is none */
+static inline long
+bs_next(uint64_t *bs, size_t n, unsigned long from)
+{
+	size_t i = from / BS_BITS;
+	uint64_t word;
 
-	memset(&key, 0, sizeof(DBT));
-	memset(&data, 0, sizeof(DBT));
+	if (i >= n)
+		return -1;
 
-	key.data = &who;
-	key.size = sizeof(who);
+	word = bs[i] & (~0ULL << (from % BS_BITS));
 
-	switch (whodb->get(whodb, NULL, &key, &data, 0)) {
-	case 0:
-		return 1;
-	case DB_NOTFOUND:
-		return 0;
-	default:
-		CBUG(1);
-		return -1;
+	while (!word) {
+		if (++i >= n)
+			return -1;
+		word = bs[i];
 	}
+
+	return i * BS_BITS + __builtin_ctzll(word);
 }
 
+#define BS_FOREACH(who, bs, n) \
+	for (long who = bs_next(bs, n, 0); who >= 0; \
+			who = bs_next(bs, n, who + 1))
+
 /******
- * ti (struct ti to struct ti primary db) related functions
+ * group related functions
  ******/
- 
-/* insert a time interval into an AVL */
-static void
-ti_insert(struct tidbs *dbs, unsigned id, time_t start, time_t end)
+
+/* Ids like "site:team:user" are in a group at each level of their prefix
+ * ("site" at level 1, "site:team" at 2), or, if they have fewer parts, in
+ * one of their own. A group is known by its first id (its leader), whose
+ * name starts with the prefix. The leaders of an id are found as soon as
+ * the id is (see g_insert), with an in-memory db of prefixes, so that
+ * rolling a query up to groups (BY LEVEL) is just a lookup in ds->groups.
+ */
+#define GROUP_SEP ':'
+#define GROUP_LEVELS 4
+
+/* length of the prefix of a name at a level (the whole name at level 0) */
+static size_t
+group_len(char *name, unsigned level)
 {
-	struct ti ti = { .min = start, .max = end, .who = id };
-	DBT key, data;
+	char *end = name;
 
-	memset(&key, 0, sizeof(DBT));
-	memset(&data, 0, sizeof(DBT));
+	if (!level)
+		return strlen(name);
 
-	key.data = &ti;
-	key.size = sizeof(ti);
-	data.data = &ti;
-	data.size = sizeof(ti);
+	for (; *end; end++)
+		if (*end == GROUP_SEP && !--level)
+			break;
 
-	CBUG(dbs->ti->put(dbs->ti, NULL, &key, &data, 0));
+	return end - name;
 }
 
-/* finish the last found interval at the provided timestamp for a certain
- * person id
+#define GROUP_KEY_MAX (USERNAME_MAX_LEN + 2)
+
+/* Point a grpdb key at the prefix of a group at a level. The level goes in
+ * the key, so that groups of different levels never share one. Returns -1
+ * if the prefix is too long to be a group.
  */
-static void
-ti_finish_last(struct tidbs *dbs, unsigned id, time_t end)
+static int
+group_key(DBT *key, char *buf, char *prefix, size_t len, unsigned level)
 {
-	struct ti ti;
-	DBT key, data;
-	DBT pkey;
-	DBC *cur;
-	int dbflags = DB_SET;
-
-	CBUG(dbs->id->cursor(dbs->id, NULL, &cur, 0));
-
-	memset(&key, 0, sizeof(DBT));
-	memset(&data, 0, sizeof(DBT));
-
-	key.data = &id;
-	key.size = sizeof(id);
-
-	do {
-		CBUG(cur->c_get(cur, &key, &data, dbflags)); // even DB_NOTFOUND
-		CBUG(* (unsigned *) key.data != id);
-		memcpy(&ti, data.data, sizeof(ti));
-		dbflags = DB_NEXT;
-	} while (ti.max != tinf);
+	if (len + 1 > GROUP_KEY_MAX)
+		return -1;
 
-	CBUG(cur->del(cur, 0));
-	cur->close(cur);
-	memset(&key, 0, sizeof(DBT));
-	key.data = data.data = &ti;
-	key.size = data.size = sizeof(ti);
-	/* ti.who = id; */
-	ti.max = end;
-	data.data = &ti;
-	data.size = sizeof(ti);
-	CBUG(dbs->ti->put(dbs->ti, NULL, &key, &data, 0));
+	buf[0] = (char) level;
+	memcpy(buf + 1, prefix, len);
+	key->data = buf;
+	key->size = len + 1;
+	return 0;
 }
 
-/* intersect an interval with an AVL of intervals */
-static inline unsigned
-ti_intersect(struct tidbs *dbs, struct match_stailq *matches, time_t min, time_t max)
+/* Find (or make) the leaders of a new id. At the levels past the parts of
+ * its name, it is a group of its own, so it leads those itself.
+ */
+static void
+group_add(unsigned id, char *name)
 {
-	struct ti tmp;
-	DBC *cur;
+	char buf[GROUP_KEY_MAX], *c;
 	DBT key, data;
-	int ret = 0, dbflags = DB_SET_RANGE;
+	unsigned level, parts = 1;
 
-	STAILQ_INIT(matches);
-	CBUG(dbs->max->cursor(dbs->max, NULL, &cur, 0));
+	if (id >= ds->groups_n) {
+		ds->groups_n = id >= ds->groups_n * 2 ? id + 1 : ds->groups_n * 2;
+		ds->groups = (unsigned *) realloc(ds->groups,
+				sizeof(unsigned) * GROUP_LEVELS * ds->groups_n);
+	}
 
 	memset(&key, 0, sizeof(DBT));
 	memset(&data, 0, sizeof(DBT));
 
-	key.data = &min;
-	key.size = sizeof(time_t);
-
-	while (1) {
-		int res = cur->c_get(cur, &key, &data, dbflags);
+	for (c = name; *c; c++)
+		parts += *c == GROUP_SEP;
 
-		if (res == DB_NOTFOUND)
-			break;
+	for (level = 1; level <= GROUP_LEVELS; level++) {
+		unsigned *leader = &ds->groups[id * GROUP_LEVELS + level - 1];
 
-		CBUG(res);
+		*leader = id;
 
-		dbflags = DB_NEXT;
-		memcpy(&tmp, data.data, sizeof(struct ti));
+		if (level > parts || group_key(&key, buf, name,
+					group_len(name, level), level))
+			continue;
 
-		if (tmp.max > min && tmp.min <= max) {
-			// its a match
-			struct match *match = (struct match *) malloc(sizeof(struct match));
-			memcpy(&match->ti, &tmp, sizeof(tmp));
-			STAILQ_INSERT_TAIL(matches, match, entry);
-			ret++;
+		if (!ds->grpdb->get(ds->grpdb, NULL, &key, &data, 0)) {
+			memcpy(leader, data.data, sizeof(unsigned));
+			continue;
 		}
-	}
 
-	cur->close(cur);
-	return ret;
+		data.data = leader;
+		data.size = sizeof(unsigned);
+		CBUG(ds->grpdb->put(ds->grpdb, NULL, &key, &data, 0));
+	}
 }
 
-/* intersect a point with an AVL of intervals */
+/* the leader of the group of an id at a level (1 to GROUP_LEVELS) */
 static inline unsigned
-ti_pintersect(struct tidbs *dbs, struct match_stailq *matches, time_t ts)
+group_of(unsigned who, unsigned level)
 {
-	return ti_intersect(dbs, matches, ts, ts);
+	return ds->groups[who * GROUP_LEVELS + level - 1];
 }
 
-int
-ti_present(struct tidbs *dbs, time_t when, unsigned who) {
-	int ret = 0, dbflags = DB_SET_RANGE;
-	struct ti tmp;
-	DBC *cur;
-	DBT key, data;
+static void
+groups_free(void)
+{
+	if (ds->grpdb)
+		CBUG(ds->grpdb->close(ds->grpdb, 0));
 
-	CBUG(dbs->max->cursor(dbs->max, NULL, &cur, 0));
+	free(ds->groups);
+	ds->grpdb = NULL;
+	ds->groups = NULL;
+	ds->groups_n = 0;
+}
 
-	memset(&key, 0, sizeof(DBT));
-	memset(&data, 0, sizeof(DBT));
+/* find the leaders of all ids of the current dataset (or snapshot) */
+static void
+groups_init(void)
+{
+	unsigned id, ids = ids_len();
 
-	key.data = &when;
-	key.size = sizeof(time_t);
+	groups_free();
+	CBUG(db_create(&ds->grpdb, dbe, 0)
+		|| ds->grpdb->open(ds->grpdb, NULL, NULL, NULL, DB_HASH, DB_CREATE, 0));
 
-	while (1) {
-		int res = cur->c_get(cur, &key, &data, dbflags);
+	for (id = 0; id < ids; id++)
+		group_add(id, gi_get(id));
+}
 
-		if (res == DB_NOTFOUND)
-			break;
+/* print the name of an id, or of its group if level isn't 0 */
+static void
+group_print(FILE *out, unsigned who, unsigned level)
+{
+	char *name = gi_get(who);
 
-		CBUG(res);
+	fprintf(out, "%.*s", (int) group_len(name, level), name);
+}
 
-		dbflags = DB_NEXT;
-		memcpy(&tmp, data.data, sizeof(struct ti));
+/* read "BY LEVEL" (with by pointing at the word that should be "BY"),
+ * returning the level, 0 without it, or -1 if it is invalid
+ */
+static int
+read_by(char *by, char *line)
+{
+	char *end;
+	long level;
 
-		if (tmp.who == who && tmp.max > when && tmp.min <= when) {
-			ret++;
-			break;
-		}
-	}
+	if (!*by)
+		return 0;
 
-	cur->close(cur);
-	return ret;
+	if (strcmp(by, "BY"))
+		return -1;
+
+	level = strtol(line, &end, 10);
+	if (end == line || !line_empty(end) || level < 1 || level > GROUP_LEVELS)
+		return -1;
+
+	return (int) level;
 }
 
 /******
- * matches related functions
+ * planner related functions
  ******/
 
-/* makes all provided matches lie within the provided interval [min, max] */
-static inline void
-matches_fix(struct match_stailq *matches, time_t min, time_t max)
+/* Intervals can be found by time (the max index, from the start of a range
+ * until the end) or by person (the id index, or the hist chunks). Which way
+ * reads fewer of them depends on the range and on the people, so a few
+ * counts are kept up to date as intervals come and go (see plan_count): how
+ * many each person has, how many end in each PLAN_PART seconds, and how many
+ * are open. They are only kept in memory, and counted again when the dbs
+ * are opened. Snapshots have sorted arrays, so they are counted exactly.
+ */
+
+/* add (sign 1) or remove (sign -1) an interval from the counts */
+static void
+plan_count(struct tidbs *dbs, struct ti *ti, int sign)
 {
-	struct match *match;
+	struct plan_stats *st = &dbs->stats;
+	time_t start = ti->max - ((ti->max % PLAN_PART) + PLAN_PART) % PLAN_PART;
+	size_t lo = 0, hi = st->parts_n, mid;
+
+	if (ti->who >= st->per_id_n) {
+		unsigned n = ti->who >= st->per_id_n * 2 ? ti->who + 1 : st->per_id_n * 2;
+
+		st->per_id = (unsigned long *) realloc(st->per_id,
+				sizeof(unsigned long) * n);
+		memset(st->per_id + st->per_id_n, 0,
+				sizeof(unsigned long) * (n - st->per_id_n));
+		st->per_id_n = n;
+	}
 
-	STAILQ_FOREACH(match, matches, entry) {
-		if (match->ti.min < min)
-			match->ti.min = min;
-		if (match->ti.max > max)
-			match->ti.max = max;
+	st->per_id[ti->who] += sign;
+	st->total += sign;
+
+	if (ti->max == tinf) {
+		st->open += sign;
+		return;
+	}
+
+	// they mostly end recently, so look at the last part first
+	if (hi && st->parts[hi - 1].start < start)
+		lo = hi;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (st->parts[mid].start < start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == st->parts_n || st->parts[lo].start != start) {
+		st->parts = (struct plan_part *) realloc(st->parts,
+				sizeof(struct plan_part) * (st->parts_n + 1));
+		memmove(st->parts + lo + 1, st->parts + lo,
+				sizeof(struct plan_part) * (st->parts_n - lo));
+		st->parts[lo].start = start;
+		st->parts[lo].count = 0;
+		st->parts_n++;
 	}
+
+	st->parts[lo].count += sign;
 }
 
+/* count the intervals that are in the dbs */
 static void
-matches_free(struct match_stailq *matches)
+plan_init(struct tidbs *dbs)
 {
-	struct match *match, *match_tmp;
+	struct ti ti;
 
-	STAILQ_FOREACH_SAFE(match, matches, entry, match_tmp) {
-		STAILQ_REMOVE_HEAD(matches, entry);
-		free(match);
+	memset(&dbs->stats, 0, sizeof(dbs->stats));
+
+	DB_ITER(dbs->ti) {
+		memcpy(&ti, data.data, sizeof(ti));
+		plan_count(dbs, &ti, 1);
+	}
+}
+
+static void
+plan_free(struct tidbs *dbs)
+{
+	free(dbs->stats.per_id);
+	free(dbs->stats.parts);
+	memset(&dbs->stats, 0, sizeof(dbs->stats));
+}
+
+/* how many intervals going by time from min reads (those that end after) */
+static unsigned long
+plan_time_rows(struct tidbs *dbs, time_t min)
+{
+	struct plan_stats *st = &dbs->stats;
+	unsigned long rows = st->open;
+	size_t i;
+
+	if (snap.base) {
+		size_t lo = 0, hi = snap.head->count, mid;
+
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (snap.by_max[mid].max < min)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		return snap.head->count - lo;
+	}
+
+	for (i = st->parts_n; i > 0 && st->parts[i - 1].start + PLAN_PART > min; i--)
+		rows += st->parts[i - 1].count;
+
+	return rows;
+}
+
+/* how many intervals a person has */
+static inline unsigned long
+plan_id_rows(struct tidbs *dbs, unsigned who)
+{
+	if (snap.base)
+		return snap.id_start[who + 1] - snap.id_start[who];
+
+	return who < dbs->stats.per_id_n ? dbs->stats.per_id[who] : 0;
+}
+
+/* choose how to find the intervals of some people (all of them, with NULL
+ * ids) that end after min. Going by person costs a lookup for each too.
+ */
+static void
+plan_ids(struct plan *plan, struct tidbs *dbs, time_t min, uint64_t *ids)
+{
+	plan->time_rows = plan_time_rows(dbs, min);
+
+	if (!ids)
+		plan->id_rows = (snap.base ? snap.head->count : dbs->stats.total)
+			+ ids_len();
+	else {
+		plan->id_rows = 0;
+		BS_FOREACH(who, ids, bs_len())
+			plan->id_rows += plan_id_rows(dbs, who) + 1;
 	}
+
+	plan->path = plan->id_rows < plan->time_rows ? PLAN_ID : PLAN_TIME;
+}
+
+/* choose how to find the intervals of a person that end after min */
+static void
+plan_who(struct plan *plan, struct tidbs *dbs, time_t min, unsigned who)
+{
+	plan->time_rows = plan_time_rows(dbs, min);
+	plan->id_rows = plan_id_rows(dbs, who) + 1;
+	plan->path = plan->id_rows < plan->time_rows ? PLAN_ID : PLAN_TIME;
+}
+
+static void
+plan_print(FILE *out, struct plan *plan)
+{
+	fprintf(out, "path %s\n", plan->path == PLAN_ID ? "id" : "time");
+	fprintf(out, "rows %lu\n", plan->path == PLAN_ID
+			? plan->id_rows : plan->time_rows);
+	fprintf(out, "time %lu id %lu\n", plan->time_rows, plan->id_rows);
 }
 
 /******
- * isplit related functions
+ * id filter related functions
  ******/
 
-/* compares isplits, so that we can sort them */
-static int
-isplit_cmp(const void *ap, const void *bp)
+/* A query can be limited to some ids (ONLY ID,...), given by name or by a
+ * prefix like "site:team:*". They are found before the query runs, into a
+ * bitset that the index scans check before anything is kept for an interval
+ * (see ti_intersect). When the planner finds that their intervals are fewer
+ * than those of the range, the scan goes through the intervals of each.
+ */
+static uint64_t *qfilter; // ids the current query is limited to, or NULL
+
+/* add the ids whose names start with a prefix to qfilter */
+static void
+filter_prefix(char *prefix)
 {
-	struct isplit a, b;
-	memcpy(&a, ap, sizeof(struct isplit));
-	memcpy(&b, bp, sizeof(struct isplit));
-	if (b.ts > a.ts)
-		return -1;
-	if (a.ts > b.ts)
-		return 1;
-	if (b.max > a.max)
-		return -1;
-	if (a.max > b.max)
-		return 1;
-	return 0;
+	size_t len = strlen(prefix), level = 0, i;
+	unsigned id, ids = ids_len(), leader = g_notfound;
+	char buf[GROUP_KEY_MAX];
+	DBT key, data;
+
+	for (i = 0; i < len; i++)
+		level += prefix[i] == GROUP_SEP;
+
+	// a whole group? then only its ids need their names checked
+	if (len && prefix[len - 1] == GROUP_SEP && level <= GROUP_LEVELS) {
+		memset(&key, 0, sizeof(DBT));
+		memset(&data, 0, sizeof(DBT));
+
+		if (group_key(&key, buf, prefix, len - 1, level)
+				|| ds->grpdb->get(ds->grpdb, NULL, &key, &data, 0))
+			return;
+
+		memcpy(&leader, data.data, sizeof(unsigned));
+	}
+
+	for (id = 0; id < ids; id++)
+		if ((leader == g_notfound || group_of(id, level) == leader)
+				&& !strncmp(gi_get(id), prefix, len))
+			bs_set(qfilter, id);
 }
 
-// assumes isplits is of size matches_l * 2
-/* creates intermediary isplits */
-static inline struct isplit *
-isplits_create(struct match_stailq *matches, size_t matches_l) {
-	struct isplit *isplits = (struct isplit *) malloc(sizeof(struct isplit) * matches_l * 2);
-	struct match *match;
-	unsigned i = 0;
+/* Limit the current query to a list of names and prefixes (ending in "*"),
+ * separated by commas
+ */
+static void
+filter_set(char *list)
+{
+	char *word, *saveptr, *star;
+	unsigned id;
 
-	STAILQ_FOREACH(match, matches, entry) {
-		struct isplit *isplit = isplits + i * 2;
-		isplit->ts = match->ti.min;
-		isplit->max = 0;
-		isplit->who = match->ti.who;
-		isplit++;
-		isplit->ts = match->ti.max;
-		isplit->max = 1;
-		isplit->who = match->ti.who;
-		i ++;
-	};
+	if (!qfilter)
+		qfilter = bs_create();
 
-	return isplits;
+	for (word = strtok_r(list, ",", &saveptr); word;
+			word = strtok_r(NULL, ",", &saveptr)) {
+		if ((star = strchr(word, '*')) && !star[1]) {
+			*star = '\0';
+			filter_prefix(word);
+		} else if ((id = g_find(word)) != g_notfound)
+			bs_set(qfilter, id);
+	}
+}
+
+/* check if an id is in a set of them (NULL being all of them) */
+static inline int
+ids_has(uint64_t *ids, unsigned who)
+{
+	return !ids || bs_test(ids, who);
+}
+
+/* check if the current query should go through the intervals of its ids,
+ * to find those that end after min
+ */
+static inline int
+filter_by_id(time_t min)
+{
+	struct plan plan;
+
+	if (!qfilter)
+		return 0;
+
+	plan_ids(&plan, &ds->pdbs, min, qfilter);
+	return plan.path == PLAN_ID;
+}
+
+static void
+filter_free(void)
+{
+	free(qfilter);
+	qfilter = NULL;
 }
 
 /******
- * split related functions
+ * hist (per-id interval history) related functions
  ******/
 
-/* Creates one split from its interval, and the list of people that are present
+/* Besides the ti db and its indexes, the intervals of each person are kept
+ * in the hist BTREE, sorted by start and packed into chunks of up to
+ * HIST_CHUNK intervals. This way, the history of one person is a couple of
+ * page reads away, instead of one lookup per interval. Inside a chunk, after
+ * a struct hist_head, each interval is two variable length integers: the
+ * distance from the end of the previous interval to its start (zigzag
+ * encoded, since it could be negative), and its length plus one (zero means
+ * it is still open).
  */
-static inline struct split *
-split_create(DB *whodb, time_t min, time_t max)
+
+#define HIST_CHUNK 128
+#define HIST_MAX_LEN (sizeof(struct hist_head) + HIST_CHUNK * 2 * 10)
+
+/* write a variable length integer, returns the number of bytes used */
+static size_t
+varint_put(unsigned char *p, uint64_t v)
 {
-	struct split *split = (struct split *) malloc(sizeof(struct split));
-	split->min = min;
-	split->max = max;
-	who_init(&split->whodb);
-	split->count = who_count(split->whodb);
-	{ DB_ITER(whodb) who_insert(split->whodb, * (unsigned *) key.data); }
-	return split;
+	size_t n = 0;
+
+	for (; v >= 0x80; v >>= 7)
+		p[n++] = (v & 0x7f) | 0x80;
+
+	p[n++] = v;
+	return n;
 }
 
-/* Creates splits from the intermediary isplit array */
-static inline void
-splits_create(
-		struct split_tailq *splits,
-		struct isplit *isplits,
-		size_t matches_l)
+/* read a variable length integer, advancing the pointer */
+static uint64_t
+varint_get(unsigned char **p)
 {
-	DB *whodb = NULL;
-	int i;
+	uint64_t v = 0;
+	int shift = 0;
 
-	TAILQ_INIT(splits);
+	for (; **p & 0x80; (*p)++, shift += 7)
+		v |= (uint64_t) (**p & 0x7f) << shift;
 
-	who_init(&whodb);
-	for (i = 0; i < matches_l * 2 - 1; i++) {
-		struct isplit *isplit = isplits + i;
-		struct isplit *isplit2 = isplits + i + 1;
-		struct split *split;
-		time_t n, m;
+	v |= (uint64_t) *(*p)++ << shift;
+	return v;
+}
 
-		if (isplit->max)
-			who_remove(whodb, isplit->who);
-		else
-			who_insert(whodb, isplit->who);
+static inline uint64_t
+zigzag(uint64_t v)
+{
+	return (v << 1) ^ -(v >> 63);
+}
 
-		n = isplit->ts;
-		m = isplit2->ts;
+static inline uint64_t
+unzigzag(uint64_t v)
+{
+	return (v >> 1) ^ -(v & 1);
+}
 
-		if (n == m)
-			continue;
+/* compares intervals by start, so that we can sort them */
+static int
+ti_min_cmp(const void *ap, const void *bp)
+{
+	struct ti a, b;
+	memcpy(&a, ap, sizeof(struct ti));
+	memcpy(&b, bp, sizeof(struct ti));
+	if (b.min > a.min)
+		return -1;
+	if (a.min > b.min)
+		return 1;
+	return b.max > a.max ? -1 : (a.max > b.max ? 1 : 0);
+}
 
-		split = split_create(whodb, n, m);
-		TAILQ_INSERT_TAIL(splits, split, entry);
+/* pack a sorted array of intervals into a chunk, returns its size */
+static size_t
+hist_encode(unsigned char *buf, struct ti *tis, unsigned n)
+{
+	struct hist_head head = { .count = n, .last = mtinf, .total = 0 };
+	unsigned char *p = buf + sizeof(head);
+	uint64_t prev = tis[0].min;
+	unsigned i;
+
+	for (i = 0; i < n; i++) {
+		struct ti *ti = &tis[i];
+
+		p += varint_put(p, zigzag((uint64_t) ti->min - prev));
+
+		if (ti->max == tinf) {
+			p += varint_put(p, 0);
+			prev = ti->min;
+		} else {
+			p += varint_put(p, (uint64_t) ti->max - ti->min + 1);
+			prev = ti->max;
+			if (ti->min != mtinf)
+				head.total += ti->max - ti->min;
+		}
+
+		if (ti->max > head.last)
+			head.last = ti->max;
 	}
-	whodb->close(whodb, 0);
+
+	memcpy(buf, &head, sizeof(head));
+	return p - buf;
 }
 
-/* From a list of matched intervals, this creates the tail queue of splits
- */
+/* unpack a chunk into an array of intervals, returns how many there are */
+static unsigned
+hist_decode(struct ti *tis, DBT *key, DBT *data)
+{
+	struct hist_key hk;
+	struct hist_head head;
+	unsigned char *p = (unsigned char *) data->data + sizeof(head);
+	uint64_t prev, len;
+	unsigned i;
+
+	memcpy(&hk, key->data, sizeof(hk));
+	memcpy(&head, data->data, sizeof(head));
+	prev = hk.min;
+
+	for (i = 0; i < head.count; i++) {
+		struct ti *ti = &tis[i];
+
+		ti->who = hk.who;
+		ti->min = prev + unzigzag(varint_get(&p));
+		len = varint_get(&p);
+
+		if (len) {
+			ti->max = ti->min + (len - 1);
+			prev = ti->max;
+		} else {
+			ti->max = tinf;
+			prev = ti->min;
+		}
+	}
+
+	return head.count;
+}
+
+/* store intervals (of one person) as a single chunk */
 static void
-splits_init(struct split_tailq *splits, struct match_stailq *matches, unsigned matches_l)
+hist_put_one(struct tidbs *dbs, struct ti *tis, unsigned n)
 {
-	struct isplit *isplits;
-	struct isplit *isplit;
-	struct isplit *buf;
-	int i = 0;
+	unsigned char buf[HIST_MAX_LEN];
+	struct hist_key hk;
+	DBT key, data;
 
-	isplits = isplits_create(matches, matches_l);
-	qsort(isplits, matches_l * 2, sizeof(struct isplit), isplit_cmp);
-	splits_create(splits, isplits, matches_l);
-	free(isplits);
+	memset(&hk, 0, sizeof(hk));
+	memset(&key, 0, sizeof(DBT));
+	memset(&data, 0, sizeof(DBT));
+
+	hk.who = tis[0].who;
+	hk.min = tis[0].min;
+	key.data = &hk;
+	key.size = sizeof(hk);
+	data.data = buf;
+	data.size = hist_encode(buf, tis, n);
+
+	CBUG(dbs->hist->put(dbs->hist, NULL, &key, &data, 0));
 }
 
-/* Obtains a tail queue of splits from the intervals that intersect the query
- * interval [min, max]
+/* store a sorted array of intervals of one person, as many chunks as needed
+ * (splitting in half what doesn't fit in one)
  */
 static void
-splits_get(struct split_tailq *splits, struct tidbs *dbs, time_t min, time_t max)
+hist_put(struct tidbs *dbs, struct ti *tis, size_t n)
 {
-	struct match_stailq matches;
-	unsigned matches_l = ti_intersect(dbs, &matches, min, max);
-	matches_fix(&matches, min, max);
-	splits_init(splits, &matches, matches_l);
-	matches_free(&matches);
+	size_t half;
+
+	if (n <= HIST_CHUNK) {
+		hist_put_one(dbs, tis, n);
+		return;
+	}
+
+	half = n <= HIST_CHUNK * 2 ? n / 2 : HIST_CHUNK;
+	hist_put_one(dbs, tis, half);
+	hist_put(dbs, tis + half, n - half);
 }
 
-/* Inserts a tail queue of splits within another, before the element provided
+/* position a cursor on the chunk where an interval of a person, starting
+ * at min, belongs: the last one that starts before it, or their first.
+ * Returns DB_NOTFOUND if the person has no chunks yet.
  */
-static inline void
-splits_concat_before(
-		struct split_tailq *target,
-		struct split_tailq *origin,
-		struct split *before)
+static int
+hist_locate(DBC *cur, DBT *key, DBT *data, unsigned who, time_t min)
 {
-	struct split *split, *tmp;
-	TAILQ_FOREACH_SAFE(split, origin, entry, tmp) {
-		TAILQ_REMOVE(origin, split, entry);
-		TAILQ_INSERT_BEFORE(before, split, entry);
+	struct hist_key hk;
+	int res;
+
+	memset(&hk, 0, sizeof(hk));
+	hk.who = who;
+	hk.min = min;
+	key->data = &hk;
+	key->size = sizeof(hk);
+
+	res = cur->c_get(cur, key, data, DB_SET_RANGE);
+	if (res != DB_NOTFOUND) {
+		CBUG(res);
+		memcpy(&hk, key->data, sizeof(hk));
+		if (hk.who == who && hk.min == min)
+			return 0;
+	}
+
+	res = cur->c_get(cur, key, data, res ? DB_LAST : DB_PREV);
+	if (res != DB_NOTFOUND) {
+		CBUG(res);
+		memcpy(&hk, key->data, sizeof(hk));
+		if (hk.who == who)
+			return 0;
+	}
+
+	// nothing starts before min, so we want the first chunk (if any)
+	hk.who = who;
+	hk.min = min;
+	key->data = &hk;
+	key->size = sizeof(hk);
+
+	res = cur->c_get(cur, key, data, DB_SET_RANGE);
+	if (res == DB_NOTFOUND)
+		return res;
+
+	CBUG(res);
+	memcpy(&hk, key->data, sizeof(hk));
+	return hk.who == who ? 0 : DB_NOTFOUND;
+}
+
+/* record a new interval in the history of its person */
+static void
+hist_add(struct tidbs *dbs, struct ti *ti)
+{
+	struct ti tis[HIST_CHUNK + 1];
+	unsigned n = 0, i;
+	DBC *cur;
+	DBT key, data;
+
+	CBUG(dbs->hist->cursor(dbs->hist, NULL, &cur, 0));
+
+	memset(&key, 0, sizeof(DBT));
+	memset(&data, 0, sizeof(DBT));
+
+	if (!hist_locate(cur, &key, &data, ti->who, ti->min)) {
+		n = hist_decode(tis, &key, &data);
+		// the chunk key changes if the interval goes first
+		if (ti->min < tis[0].min)
+			CBUG(cur->c_del(cur, 0));
+	}
+
+	cur->close(cur);
+
+	for (i = n; i > 0 && ti_min_cmp(&tis[i - 1], ti) > 0; i--)
+		tis[i] = tis[i - 1];
+
+	tis[i] = *ti;
+	hist_put(dbs, tis, n + 1);
+}
+
+/* finish the open interval of a person (that started at min) in their
+ * history
+ */
+static void
+hist_finish(struct tidbs *dbs, unsigned who, time_t min, time_t end)
+{
+	struct ti tis[HIST_CHUNK];
+	unsigned n = 0, i;
+	DBC *cur;
+	DBT key, data;
+
+	CBUG(dbs->hist->cursor(dbs->hist, NULL, &cur, 0));
+
+	memset(&key, 0, sizeof(DBT));
+	memset(&data, 0, sizeof(DBT));
+
+	if (!hist_locate(cur, &key, &data, who, min))
+		n = hist_decode(tis, &key, &data);
+
+	cur->close(cur);
+
+	for (i = 0; i < n; i++)
+		if (tis[i].min == min && tis[i].max == tinf)
+			break;
+
+	CBUG(i >= n);
+	tis[i].max = end;
+	hist_put(dbs, tis, n);
+}
+
+/* build the hist db out of the id index, if it is empty (for dbs that were
+ * created before it existed)
+ */
+static void
+hist_rebuild(struct tidbs *dbs)
+{
+	struct ti *tis = NULL, ti;
+	size_t n = 0, size = 0;
+	DBC *cur;
+	DBT key, data;
+	int res;
+
+	memset(&key, 0, sizeof(DBT));
+	memset(&data, 0, sizeof(DBT));
+
+	CBUG(dbs->hist->cursor(dbs->hist, NULL, &cur, 0));
+	res = cur->c_get(cur, &key, &data, DB_FIRST);
+	cur->close(cur);
+
+	if (res != DB_NOTFOUND) {
+		CBUG(res);
+		return;
+	}
+
+	CBUG(dbs->id->cursor(dbs->id, NULL, &cur, 0));
+
+	while (1) {
+		res = cur->c_get(cur, &key, &data, DB_NEXT);
+
+		if (res == DB_NOTFOUND)
+			break;
+
+		CBUG(res);
+		memcpy(&ti, data.data, sizeof(ti));
+
+		if (n && tis[0].who != ti.who) {
+			qsort(tis, n, sizeof(struct ti), ti_min_cmp);
+			hist_put(dbs, tis, n);
+			n = 0;
+		}
+
+		if (n == size) {
+			size = size ? size * 2 : HIST_CHUNK;
+			tis = (struct ti *) realloc(tis, sizeof(struct ti) * size);
+		}
+
+		tis[n++] = ti;
+	}
+
+	cur->close(cur);
+
+	if (n) {
+		qsort(tis, n, sizeof(struct ti), ti_min_cmp);
+		hist_put(dbs, tis, n);
+	}
+
+	free(tis);
+}
+
+/******
+ * snapshot related functions
+ ******/
+
+/* A snapshot is a read-only copy of the dbs, in a single file that can be
+ * mapped into memory and queried as is. After a header, it has these
+ * sections, each starting at a page boundary:
+ *
+ * - names: the usernames, '\0' terminated, one after the other
+ * - name_off: where the username of each id starts (in names)
+ * - by_name: ids sorted by username (for finding ids)
+ * - by_max: intervals sorted by their max (like the max index)
+ * - min_suffix: for each interval in by_max, the smallest min from there on
+ *   (so that interval queries know when to stop)
+ * - by_id: intervals sorted by id and then min (like the hist db)
+ * - id_start: where the intervals of each id start (in by_id)
+ *
+ * Everything is stored in the native format of the machine that wrote it,
+ * and the header records enough to reject what doesn't match.
+ */
+
+#define SNAP_MAGIC "itsnap"
+#define SNAP_VERSION 1
+
+struct snap_name {
+	char *name;
+	unsigned id;
+};
+
+static int
+snap_name_cmp(const void *ap, const void *bp)
+{
+	return strcmp(((struct snap_name *) ap)->name,
+			((struct snap_name *) bp)->name);
+}
+
+static int
+ti_max_cmp(const void *ap, const void *bp)
+{
+	struct ti a, b;
+	memcpy(&a, ap, sizeof(struct ti));
+	memcpy(&b, bp, sizeof(struct ti));
+	return b.max > a.max ? -1 : (a.max > b.max ? 1 : 0);
+}
+
+static int
+ti_who_cmp(const void *ap, const void *bp)
+{
+	struct ti a, b;
+	memcpy(&a, ap, sizeof(struct ti));
+	memcpy(&b, bp, sizeof(struct ti));
+	if (a.who != b.who)
+		return b.who > a.who ? -1 : 1;
+	return ti_min_cmp(ap, bp);
+}
+
+/* write a section of a snapshot, at the next page boundary */
+static int
+snap_section(FILE *fp, uint64_t *off, void *data, size_t len)
+{
+	long page = sysconf(_SC_PAGESIZE), pos = ftell(fp);
+
+	for (; pos % page; pos++)
+		fputc(0, fp);
+
+	*off = pos;
+	return len && fwrite(data, 1, len, fp) != len;
+}
+
+/* Write a snapshot of the dbs into path. It is written to a temporary file
+ * which is then renamed over path, so that whoever maps path sees either the
+ * old snapshot or the new one. Returns the number of intervals written or
+ * -1 on failure.
+ */
+static long
+snap_write(char *path)
+{
+	struct snap_head head;
+	struct snap_name *sns;
+	struct ti *by_max = NULL, *by_id;
+	time_t *min_suffix;
+	uint64_t *name_off, *id_start, names_len = 0, i, count = 0, size = 0;
+	unsigned *by_name, ids = ds->g_len;
+	char *names, tmp[PATH_MAX];
+	FILE *fp;
+	int ret;
+
+	mt_flush(&ds->pdbs);
+	sns = (struct snap_name *) calloc(ids, sizeof(struct snap_name));
+
+	{
+		DB_ITER(ds->gdb) {
+			unsigned id;
+			memcpy(&id, data.data, sizeof(id));
+			if (id >= ids || sns[id].name)
+				continue;
+			sns[id].name = strdup(key.data);
+			sns[id].id = id;
+			names_len += key.size;
+		}
+	}
+
+	{
+		DB_ITER(ds->pdbs.max) {
+			if (count == size) {
+				size = size ? size * 2 : 1024;
+				by_max = (struct ti *) realloc(by_max, sizeof(struct ti) * size);
+			}
+			memcpy(&by_max[count++], data.data, sizeof(struct ti));
+		}
+	}
+
+	names = (char *) malloc(names_len + 1);
+	name_off = (uint64_t *) malloc(sizeof(uint64_t) * (ids + 1));
+	by_name = (unsigned *) malloc(sizeof(unsigned) * (ids + 1));
+	min_suffix = (time_t *) malloc(sizeof(time_t) * (count + 1));
+	by_id = (struct ti *) malloc(sizeof(struct ti) * (count + 1));
+	id_start = (uint64_t *) calloc(ids + 1, sizeof(uint64_t));
+
+	for (names_len = 0, i = 0; i < ids; i++) {
+		name_off[i] = names_len;
+		if (!sns[i].name)
+			sns[i].name = strdup("");
+		strcpy(names + names_len, sns[i].name);
+		names_len += strlen(sns[i].name) + 1;
+	}
+
+	qsort(sns, ids, sizeof(struct snap_name), snap_name_cmp);
+	for (i = 0; i < ids; i++) {
+		by_name[i] = sns[i].id;
+		free(sns[i].name);
+	}
+
+	for (i = count; i > 0; i--)
+		min_suffix[i - 1] = i < count && min_suffix[i] < by_max[i - 1].min
+			? min_suffix[i] : by_max[i - 1].min;
+
+	memcpy(by_id, by_max, sizeof(struct ti) * count);
+	qsort(by_id, count, sizeof(struct ti), ti_who_cmp);
+	for (i = 0; i < count; i++)
+		id_start[by_id[i].who + 1] = i + 1;
+	for (i = 1; i <= ids; i++)
+		if (id_start[i] < id_start[i - 1])
+			id_start[i] = id_start[i - 1];
+
+	memset(&head, 0, sizeof(head));
+	strcpy(head.magic, SNAP_MAGIC);
+	head.version = SNAP_VERSION;
+	head.ti_size = sizeof(struct ti);
+	head.time_size = sizeof(time_t);
+	head.ids = ids;
+	head.count = count;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fp = fopen(tmp, "w");
+	ret = !fp || fwrite(&head, sizeof(head), 1, fp) != 1
+		|| snap_section(fp, &head.names_off, names, names_len)
+		|| snap_section(fp, &head.name_off_off, name_off, sizeof(uint64_t) * ids)
+		|| snap_section(fp, &head.by_name_off, by_name, sizeof(unsigned) * ids)
+		|| snap_section(fp, &head.by_max_off, by_max, sizeof(struct ti) * count)
+		|| snap_section(fp, &head.min_suffix_off, min_suffix, sizeof(time_t) * count)
+		|| snap_section(fp, &head.by_id_off, by_id, sizeof(struct ti) * count)
+		|| snap_section(fp, &head.id_start_off, id_start, sizeof(uint64_t) * (ids + 1))
+		|| (head.size = ftell(fp), fseek(fp, 0, SEEK_SET))
+		|| fwrite(&head, sizeof(head), 1, fp) != 1
+		|| fflush(fp) || fsync(fileno(fp));
+
+	if (fp)
+		ret = fclose(fp) || ret;
+
+	ret = ret || rename(tmp, path);
+	if (ret)
+		unlink(tmp);
+
+	free(sns);
+	free(names);
+	free(name_off);
+	free(by_name);
+	free(by_max);
+	free(min_suffix);
+	free(by_id);
+	free(id_start);
+	return ret ? -1 : (long) count;
+}
+
+/* Map a snapshot file, replacing the one being served, if any. Returns 0 on
+ * success, or -1 if the file can't be used (keeping the current one).
+ */
+static int
+snap_open(char *path)
+{
+	struct snap_head head;
+	struct stat st;
+	void *base;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) || st.st_size < sizeof(head)
+			|| read(fd, &head, sizeof(head)) != sizeof(head)
+			|| strcmp(head.magic, SNAP_MAGIC)
+			|| head.version != SNAP_VERSION
+			|| head.ti_size != sizeof(struct ti)
+			|| head.time_size != sizeof(time_t)
+			|| head.size != st.st_size
+			|| head.id_start_off + sizeof(uint64_t) * (head.ids + 1) > st.st_size) {
+		close(fd);
+		return -1;
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (base == MAP_FAILED)
+		return -1;
+
+	if (snap.base)
+		munmap(snap.base, snap.size);
+
+	snap.path = path;
+	snap.base = base;
+	snap.size = st.st_size;
+	snap.ino = st.st_ino;
+	snap.mtime = st.st_mtime;
+	snap.head = (struct snap_head *) base;
+	snap.names = (char *) base + head.names_off;
+	snap.name_off = (uint64_t *) ((char *) base + head.name_off_off);
+	snap.by_name = (unsigned *) ((char *) base + head.by_name_off);
+	snap.by_max = (struct ti *) ((char *) base + head.by_max_off);
+	snap.min_suffix = (time_t *) ((char *) base + head.min_suffix_off);
+	snap.by_id = (struct ti *) ((char *) base + head.by_id_off);
+	snap.id_start = (uint64_t *) ((char *) base + head.id_start_off);
+	return 0;
+}
+
+/* map the snapshot again if its file was replaced */
+static void
+snap_check(void)
+{
+	struct stat st;
+
+	if (stat(snap.path, &st) || (st.st_ino == snap.ino
+				&& st.st_mtime == snap.mtime))
+		return;
+
+	if (snap_open(snap.path))
+		warnx("%s: not a valid snapshot, keeping the old one", snap.path);
+	else {
+		rcache_invalidate(NULL, mtinf, tinf);
+		groups_init();
+	}
+}
+
+/* find the id of a username in the snapshot */
+static unsigned
+snap_find(char *name)
+{
+	size_t lo = 0, hi = snap.head->ids;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		unsigned id = snap.by_name[mid];
+		int cmp = strcmp(snap.names + snap.name_off[id], name);
+
+		if (!cmp)
+			return id;
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return g_notfound;
+}
+
+/* add an interval to a list of matches */
+static inline void
+match_add(struct match_stailq *matches, struct ti *ti)
+{
+	struct match *match = (struct match *) malloc(sizeof(struct match));
+	memcpy(&match->ti, ti, sizeof(struct ti));
+	STAILQ_INSERT_TAIL(matches, match, entry);
+}
+
+/* intersect an interval with the intervals of the snapshot */
+static unsigned
+snap_intersect(struct match_stailq *matches, time_t min, time_t max)
+{
+	size_t lo = 0, hi = snap.head->count, i;
+	unsigned ret = 0;
+
+	STAILQ_INIT(matches);
+
+	if (filter_by_id(min)) {
+		BS_FOREACH(who, qfilter, bs_len())
+			for (i = snap.id_start[who]; i < snap.id_start[who + 1]
+					&& snap.by_id[i].min <= max; i++)
+				if (snap.by_id[i].max > min) {
+					match_add(matches, &snap.by_id[i]);
+					ret++;
+				}
+
+		return ret;
+	}
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (snap.by_max[mid].max < min)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (i = lo; i < snap.head->count && snap.min_suffix[i] <= max; i++) {
+		struct ti *ti = &snap.by_max[i];
+
+		if (ti->max > min && ti->min <= max && ids_has(qfilter, ti->who)) {
+			match_add(matches, ti);
+			ret++;
+		}
+	}
+
+	return ret;
+}
+
+/******
+ * ti (struct ti to struct ti primary db) related functions
+ ******/
+ 
+/* put a time interval into the primary db (and so the indexes) */
+static void
+ti_put(struct tidbs *dbs, struct ti *ti)
+{
+	DBT key, data;
+
+	memset(&key, 0, sizeof(DBT));
+	memset(&data, 0, sizeof(DBT));
+
+	key.data = ti;
+	key.size = sizeof(struct ti);
+	data.data = ti;
+	data.size = sizeof(struct ti);
+
+	CBUG(dbs->ti->put(dbs->ti, NULL, &key, &data, 0));
+	plan_count(dbs, ti, 1);
+}
+
+/* insert a time interval into an AVL */
+static void
+ti_insert(struct tidbs *dbs, unsigned id, time_t start, time_t end)
+{
+	struct ti ti;
+
+	memset(&ti, 0, sizeof(ti));
+	ti.min = start;
+	ti.max = end;
+	ti.who = id;
+
+	ti_put(dbs, &ti);
+	hist_add(dbs, &ti);
+}
+
+/* finish the open interval of a person that starts at min, at the provided
+ * timestamp
+ */
+static void
+ti_finish(struct tidbs *dbs, unsigned id, time_t min, time_t end)
+{
+	struct ti ti;
+	DBT key, data;
+	DBT pkey;
+	DBC *cur;
+	int dbflags = DB_SET;
+
+	CBUG(dbs->id->cursor(dbs->id, NULL, &cur, 0));
+
+	memset(&key, 0, sizeof(DBT));
+	memset(&data, 0, sizeof(DBT));
+
+	key.data = &id;
+	key.size = sizeof(id);
+
+	do {
+		CBUG(cur->c_get(cur, &key, &data, dbflags)); // even DB_NOTFOUND
+		CBUG(* (unsigned *) key.data != id);
+		memcpy(&ti, data.data, sizeof(ti));
+		dbflags = DB_NEXT;
+	} while (ti.max != tinf || ti.min != min);
+
+	CBUG(cur->del(cur, 0));
+	cur->close(cur);
+	plan_count(dbs, &ti, -1);
+	memset(&key, 0, sizeof(DBT));
+	key.data = data.data = &ti;
+	key.size = data.size = sizeof(ti);
+	/* ti.who = id; */
+	ti.max = end;
+	data.data = &ti;
+	data.size = sizeof(ti);
+	CBUG(dbs->ti->put(dbs->ti, NULL, &key, &data, 0));
+	plan_count(dbs, &ti, 1);
+	hist_finish(dbs, id, ti.min, end);
+}
+
+/* find the start of the interval of a person that is open in the dbs (and
+ * that wasn't finished in the memtable), returns 0 if there is one
+ */
+static int
+ti_open_min(struct tidbs *dbs, unsigned id, time_t *min)
+{
+	struct ti ti;
+	DBT key, data;
+	DBC *cur;
+	int res, dbflags = DB_SET;
+
+	CBUG(dbs->id->cursor(dbs->id, NULL, &cur, 0));
+
+	memset(&key, 0, sizeof(DBT));
+	memset(&data, 0, sizeof(DBT));
+
+	key.data = &id;
+	key.size = sizeof(id);
+
+	while (1) {
+		res = cur->c_get(cur, &key, &data, dbflags);
+
+		if (res == DB_NOTFOUND)
+			break;
+
+		CBUG(res);
+		dbflags = DB_NEXT_DUP;
+		memcpy(&ti, data.data, sizeof(ti));
+
+		if (ti.max == tinf && mt_end(dbs, id, ti.min) == tinf) {
+			*min = ti.min;
+			break;
+		}
+	}
+
+	cur->close(cur);
+	return res;
+}
+
+/* intersect an interval with the intervals of some ids, going through the
+ * id index
+ */
+static unsigned
+ti_intersect_ids(struct tidbs *dbs, struct match_stailq *matches,
+		time_t min, time_t max, uint64_t *ids)
+{
+	struct ti tmp;
+	DBC *cur;
+	DBT key, data;
+	unsigned ret = 0;
+
+	CBUG(dbs->id->cursor(dbs->id, NULL, &cur, 0));
+
+	BS_FOREACH(who, ids, bs_len()) {
+		unsigned id = who;
+		int dbflags = DB_SET;
+
+		memset(&key, 0, sizeof(DBT));
+		memset(&data, 0, sizeof(DBT));
+		key.data = &id;
+		key.size = sizeof(id);
+
+		while (1) {
+			int res = cur->c_get(cur, &key, &data, dbflags);
+
+			if (res == DB_NOTFOUND)
+				break;
+
+			CBUG(res);
+			dbflags = DB_NEXT_DUP;
+			memcpy(&tmp, data.data, sizeof(struct ti));
+
+			if (tmp.max == tinf)
+				tmp.max = mt_end(dbs, tmp.who, tmp.min);
+
+			if (tmp.max > min && tmp.min <= max) {
+				match_add(matches, &tmp);
+				ret++;
+			}
+		}
+	}
+
+	cur->close(cur);
+	return ret;
+}
+
+/* intersect an interval with the intervals of some ids (NULL being all of
+ * them), going through the max index
+ */
+static unsigned
+ti_intersect_time(struct tidbs *dbs, struct match_stailq *matches,
+		time_t min, time_t max, uint64_t *ids)
+{
+	struct ti tmp;
+	DBC *cur;
+	DBT key, data;
+	int ret = 0, dbflags = DB_SET_RANGE;
+
+	CBUG(dbs->max->cursor(dbs->max, NULL, &cur, 0));
+
+	memset(&key, 0, sizeof(DBT));
+	memset(&data, 0, sizeof(DBT));
+
+	key.data = &min;
+	key.size = sizeof(time_t);
+
+	while (1) {
+		int res = cur->c_get(cur, &key, &data, dbflags);
+
+		if (res == DB_NOTFOUND)
+			break;
+
+		CBUG(res);
+
+		dbflags = DB_NEXT;
+		memcpy(&tmp, data.data, sizeof(struct ti));
+
+		if (!ids_has(ids, tmp.who))
+			continue;
+
+		if (tmp.max == tinf)
+			tmp.max = mt_end(dbs, tmp.who, tmp.min);
+
+		if (tmp.max > min && tmp.min <= max) {
+			// its a match
+			match_add(matches, &tmp);
+			ret++;
+		}
+	}
+
+	cur->close(cur);
+	return ret;
+}
+
+/* intersect an interval with an AVL of intervals (only those of the ids
+ * in qfilter, if the query has one, in the way the planner chooses)
+ */
+static inline unsigned
+ti_intersect(struct tidbs *dbs, struct match_stailq *matches, time_t min, time_t max)
+{
+	unsigned ret;
+
+	if (snap.base)
+		return snap_intersect(matches, min, max);
+
+	STAILQ_INIT(matches);
+
+	if (filter_by_id(min))
+		ret = ti_intersect_ids(dbs, matches, min, max, qfilter);
+	else
+		ret = ti_intersect_time(dbs, matches, min, max, qfilter);
+
+	return ret + mt_intersect(dbs, matches, min, max, qfilter);
+}
+
+/* intersect a point with an AVL of intervals */
+static inline unsigned
+ti_pintersect(struct tidbs *dbs, struct match_stailq *matches, time_t ts)
+{
+	return ti_intersect(dbs, matches, ts, ts);
+}
+
+int
+ti_present(struct tidbs *dbs, time_t when, unsigned who) {
+	int ret = 0, dbflags = DB_SET_RANGE, next = DB_NEXT;
+	struct plan plan;
+	struct ti tmp;
+	DBC *cur;
+	DBT key, data;
+
+	if (mt_present(dbs, when, who))
+		return 1;
+
+	memset(&key, 0, sizeof(DBT));
+	memset(&data, 0, sizeof(DBT));
+
+	// through the intervals that end after when, or those of who
+	plan_who(&plan, dbs, when, who);
+	if (plan.path == PLAN_ID) {
+		CBUG(dbs->id->cursor(dbs->id, NULL, &cur, 0));
+		key.data = &who;
+		key.size = sizeof(who);
+		dbflags = DB_SET;
+		next = DB_NEXT_DUP;
+	} else {
+		CBUG(dbs->max->cursor(dbs->max, NULL, &cur, 0));
+		key.data = &when;
+		key.size = sizeof(time_t);
+	}
+
+	while (1) {
+		int res = cur->c_get(cur, &key, &data, dbflags);
+
+		if (res == DB_NOTFOUND)
+			break;
+
+		CBUG(res);
+
+		dbflags = next;
+		memcpy(&tmp, data.data, sizeof(struct ti));
+
+		if (tmp.who == who && tmp.max == tinf)
+			tmp.max = mt_end(dbs, who, tmp.min);
+
+		if (tmp.who == who && tmp.max > when && tmp.min <= when) {
+			ret++;
+			break;
+		}
+	}
+
+	cur->close(cur);
+	return ret;
+}
+
+/******
+ * memtable related functions
+ ******/
+
+/* START and STOP events don't go to the dbs right away. They are absorbed
+ * by the memtable, a small array of changes that is flushed into the dbs in
+ * batches: when it fills up, or once its oldest change is mt_delay seconds
+ * old (see main). Entries are either new intervals (which may be open, and
+ * later finished in place) or the end of an interval that is open in the
+ * dbs. Whoever reads the dbs merges the memtable in (see ti_intersect).
+ */
+
+#define MT_MAX 1024
+
+time_t mt_delay = 5;
+
+/* get the end of an interval that is open in the dbs, as the memtable sees
+ * it
+ */
+static time_t
+mt_end(struct tidbs *dbs, unsigned who, time_t min)
+{
+	size_t i;
+
+	for (i = 0; i < dbs->mt_len; i++) {
+		struct mt_ent *ent = &dbs->mt[i];
+		if (ent->finish && ent->ti.who == who && ent->ti.min == min)
+			return ent->ti.max;
+	}
+
+	return tinf;
+}
+
+/* check if a person is present at a certain time, in new intervals only */
+static int
+mt_present(struct tidbs *dbs, time_t when, unsigned who)
+{
+	size_t i;
+
+	for (i = 0; i < dbs->mt_len; i++) {
+		struct mt_ent *ent = &dbs->mt[i];
+		if (!ent->finish && ent->ti.who == who
+				&& ent->ti.max > when && ent->ti.min <= when)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* add new intervals (of some ids, NULL being all of them) that intersect
+ * [min, max] to a list of matches
+ */
+static unsigned
+mt_intersect(struct tidbs *dbs, struct match_stailq *matches,
+		time_t min, time_t max, uint64_t *ids)
+{
+	unsigned ret = 0;
+	size_t i;
+
+	for (i = 0; i < dbs->mt_len; i++) {
+		struct mt_ent *ent = &dbs->mt[i];
+
+		if (ent->finish || ent->ti.max <= min || ent->ti.min > max
+				|| !ids_has(ids, ent->ti.who))
+			continue;
+
+		match_add(matches, &ent->ti);
+		ret++;
+	}
+
+	return ret;
+}
+
+/* Write the memtable into the dbs. The changes are sorted by max, so that
+ * the max index is written in order, and so that intervals that are open in
+ * the dbs get finished before new open intervals are inserted.
+ */
+static void
+mt_flush(struct tidbs *dbs)
+{
+	size_t i;
+
+	qsort(dbs->mt, dbs->mt_len, sizeof(struct mt_ent), ti_max_cmp);
+
+	for (i = 0; i < dbs->mt_len; i++) {
+		struct ti *ti = &dbs->mt[i].ti;
+
+		if (dbs->mt[i].finish)
+			ti_finish(dbs, ti->who, ti->min, ti->max);
+		else
+			ti_insert(dbs, ti->who, ti->min, ti->max);
+	}
+
+	dbs->mt_len = 0;
+}
+
+/* add a change to the memtable, flushing it first if it is full */
+static void
+mt_add(struct tidbs *dbs, unsigned who, time_t min, time_t max, int finish)
+{
+	struct mt_ent *ent;
+
+	if (!dbs->mt)
+		dbs->mt = (struct mt_ent *) malloc(sizeof(struct mt_ent) * MT_MAX);
+
+	if (dbs->mt_len == MT_MAX)
+		mt_flush(dbs);
+
+	if (!dbs->mt_len)
+		dbs->mt_time = time(NULL);
+
+	ent = &dbs->mt[dbs->mt_len++];
+	memset(ent, 0, sizeof(struct mt_ent));
+	ent->ti.who = who;
+	ent->ti.min = min;
+	ent->ti.max = max;
+	ent->finish = finish;
+}
+
+/* insert a new time interval */
+static void
+mt_insert(struct tidbs *dbs, unsigned id, time_t start, time_t end)
+{
+	mt_add(dbs, id, start, end, 0);
+}
+
+/* finish the open interval of a person at the provided timestamp, be it in
+ * the memtable or in the dbs
+ */
+static void
+mt_finish(struct tidbs *dbs, unsigned id, time_t end)
+{
+	time_t min;
+	size_t i;
+
+	for (i = 0; i < dbs->mt_len; i++) {
+		struct mt_ent *ent = &dbs->mt[i];
+		if (!ent->finish && ent->ti.who == id && ent->ti.max == tinf) {
+			ent->ti.max = end;
+			return;
+		}
+	}
+
+	if (!ti_open_min(dbs, id, &min))
+		mt_add(dbs, id, min, end, 1);
+}
+
+/******
+ * compaction related functions
+ ******/
+
+/* Noisy sources STOP and START the same person seconds apart, which leaves
+ * many tiny intervals behind, that every query then has to go through.
+ * Compaction merges the intervals of a person that overlap or that are at
+ * most compact_gap seconds apart, rewriting them (along with the indexes and
+ * the hist chunks). It goes through a few people at a time whenever we are
+ * idle (see main), or through everybody with "itd -c" or COMPACT.
+ */
+
+#define COMPACT_BATCH 64
+#define TI_REC_SIZE (2 * sizeof(struct ti) + sizeof(time_t) \
+		+ sizeof(unsigned) + 2 * sizeof(struct ti))
+
+time_t compact_gap = 0;
+
+/* read all the intervals of a person from their hist chunks, returns how
+ * many there are
+ */
+static size_t
+hist_get(struct tidbs *dbs, unsigned who, struct ti **tis)
+{
+	struct hist_key hk;
+	size_t n = 0, size = 0;
+	int dbflags = DB_SET_RANGE;
+	DBC *cur;
+	DBT key, data;
+
+	*tis = NULL;
+	CBUG(dbs->hist->cursor(dbs->hist, NULL, &cur, 0));
+
+	memset(&hk, 0, sizeof(hk));
+	memset(&key, 0, sizeof(DBT));
+	memset(&data, 0, sizeof(DBT));
+
+	hk.who = who;
+	hk.min = mtinf;
+	key.data = &hk;
+	key.size = sizeof(hk);
+
+	while (1) {
+		int res = cur->c_get(cur, &key, &data, dbflags);
+
+		if (res == DB_NOTFOUND)
+			break;
+
+		CBUG(res);
+		dbflags = DB_NEXT;
+		memcpy(&hk, key.data, sizeof(hk));
+
+		if (hk.who != who)
+			break;
+
+		if (n + HIST_CHUNK > size) {
+			size = size ? size * 2 : HIST_CHUNK * 2;
+			*tis = (struct ti *) realloc(*tis, sizeof(struct ti) * size);
+		}
+
+		n += hist_decode(*tis + n, &key, &data);
+	}
+
+	cur->close(cur);
+	return n;
+}
+
+/* remove all the hist chunks of a person */
+static void
+hist_drop(struct tidbs *dbs, unsigned who)
+{
+	struct hist_key hk;
+	int dbflags = DB_SET_RANGE;
+	DBC *cur;
+	DBT key, data;
+
+	CBUG(dbs->hist->cursor(dbs->hist, NULL, &cur, 0));
+
+	memset(&hk, 0, sizeof(hk));
+	memset(&key, 0, sizeof(DBT));
+	memset(&data, 0, sizeof(DBT));
+
+	hk.who = who;
+	hk.min = mtinf;
+	key.data = &hk;
+	key.size = sizeof(hk);
+
+	while (1) {
+		int res = cur->c_get(cur, &key, &data, dbflags);
+
+		if (res == DB_NOTFOUND)
+			break;
+
+		CBUG(res);
+		dbflags = DB_NEXT;
+		memcpy(&hk, key.data, sizeof(hk));
+
+		if (hk.who != who)
+			break;
+
+		CBUG(cur->c_del(cur, 0));
+	}
+
+	cur->close(cur);
+}
+
+/* merge the intervals of a person, returns how many there were before (or
+ * zero if nothing changed), and puts how many are left in *after
+ */
+static size_t
+compact_id(struct tidbs *dbs, unsigned who, size_t *after)
+{
+	struct ti *tis, *merged;
+	size_t n = hist_get(dbs, who, &tis), m = 0, i;
+	DBT key;
+
+	// merged apart, since the planner has to forget the old ones
+	merged = (struct ti *) malloc(sizeof(struct ti) * (n + 1));
+
+	for (i = 0; i < n; i++) {
+		if (m) {
+			struct ti *last = &merged[m - 1];
+
+			if (last->max == tinf)
+				continue; // it is open, so it covers what's after
+
+			if (tis[i].min <= last->max
+					|| tis[i].min - last->max <= compact_gap) {
+				if (tis[i].max > last->max)
+					last->max = tis[i].max;
+				continue;
+			}
+		}
+
+		merged[m++] = tis[i];
+	}
+
+	if (m == n) {
+		free(merged);
+		free(tis);
+		return 0;
+	}
+
+	// deleting from the id index deletes all the person's intervals
+	memset(&key, 0, sizeof(DBT));
+	key.data = &who;
+	key.size = sizeof(who);
+	CBUG(dbs->id->del(dbs->id, NULL, &key, 0));
+	for (i = 0; i < n; i++)
+		plan_count(dbs, &tis[i], -1);
+
+	for (i = 0; i < m; i++)
+		ti_put(dbs, &merged[i]);
+
+	hist_drop(dbs, who);
+	hist_put(dbs, merged, m);
+
+	// merged intervals are disjoint and sorted, so these are the bounds
+	rcache_invalidate(ds, merged[0].min, merged[m - 1].max);
+	rollup_invalidate(merged[0].min, merged[m - 1].max);
+
+	free(merged);
+	free(tis);
+	*after = m;
+	return n;
+}
+
+/* compact a number of people, starting at *next and wrapping around */
+static void
+compact_some(struct tidbs *dbs, unsigned *next, unsigned count,
+		struct compact_stats *st)
+{
+	size_t before, after;
+
+	mt_flush(dbs);
+
+	for (; count && ds->g_len; count--, *next = (*next + 1) % ds->g_len) {
+		before = compact_id(dbs, *next % ds->g_len, &after);
+		if (!before)
+			continue;
+
+		st->ids++;
+		st->before += before;
+		st->after += after;
+	}
+}
+
+/* print what a compaction did */
+static void
+compact_print(FILE *out, char *what, struct compact_stats *st)
+{
+	fprintf(out, "%s: %lu ids, %lu -> %lu intervals, %lu bytes saved\n",
+			what, st->ids, st->before, st->after,
+			(st->before - st->after) * TI_REC_SIZE);
+}
+
+/******
+ * retention related functions
+ ******/
+
+/* With -R, closed intervals that ended more than retain_secs ago are
+ * deleted, RETAIN_BATCH at a time whenever we are idle (so that queries
+ * never wait on it for long). The max index is sorted by the end of the
+ * intervals, so these are always at its start. With -A, they are first
+ * appended to a gzip file, as START and STOP lines that can be fed back.
+ */
+
+#define RETAIN_BATCH 256
+
+time_t retain_secs = 0; // zero means forever
+char *retain_archive = NULL;
+
+/* compare two person ids (for qsort) */
+static int
+unsigned_cmp(const void *a, const void *b)
+{
+	unsigned ua = * (unsigned *) a, ub = * (unsigned *) b;
+	return ub > ua ? -1 : (ua > ub ? 1 : 0);
+}
+
+/* remove intervals that ended before horizon from the hist chunks of a
+ * person
+ */
+static void
+hist_expire(struct tidbs *dbs, unsigned who, time_t horizon)
+{
+	struct ti *tis;
+	size_t n = hist_get(dbs, who, &tis), m = 0, i;
+
+	for (i = 0; i < n; i++)
+		if (tis[i].max == tinf || tis[i].max >= horizon)
+			tis[m++] = tis[i];
+
+	if (m != n) {
+		hist_drop(dbs, who);
+		if (m)
+			hist_put(dbs, tis, m);
+	}
+
+	free(tis);
+}
+
+/* append an interval to the archive, as input lines */
+static void
+retain_archive_ti(gzFile gz, struct ti *ti)
+{
+	char date[DATE_MAX_LEN];
+	char *name = gi_get(ti->who);
+
+	if (ti->min != mtinf)
+		gzprintf(gz, "START %s %s\n", printtime_r(date, ti->min), name);
+
+	gzprintf(gz, "STOP %s %s\n", printtime_r(date, ti->max), name);
+}
+
+/* delete (up to count) intervals that are past the horizon, returns how
+ * many were deleted
+ */
+static unsigned
+retain_some(struct tidbs *dbs, unsigned count)
+{
+	time_t horizon = time(NULL) - retain_secs;
+	unsigned *whos = (unsigned *) malloc(sizeof(unsigned) * count);
+	unsigned n = 0, i;
+	gzFile gz = NULL;
+	struct ti ti;
+	DBC *cur;
+	DBT key, data;
+
+	CBUG(dbs->max->cursor(dbs->max, NULL, &cur, 0));
+
+	memset(&key, 0, sizeof(DBT));
+	memset(&data, 0, sizeof(DBT));
+
+	while (n < count) {
+		int res = cur->c_get(cur, &key, &data, DB_NEXT);
+
+		if (res == DB_NOTFOUND)
+			break;
+
+		CBUG(res);
+		memcpy(&ti, data.data, sizeof(ti));
+
+		if (ti.max >= horizon)
+			break;
+
+		// opened on the first one, so idle ticks don't append empty members
+		if (retain_archive && !n) {
+			gz = gzopen(retain_archive, "ab");
+			if (!gz)
+				warn("%s", retain_archive);
+			else // so that it is fed back into the same dataset
+				gzprintf(gz, "USE %s\n", ds->name);
+		}
+
+		if (gz)
+			retain_archive_ti(gz, &ti);
+
+		CBUG(cur->c_del(cur, 0));
+		plan_count(dbs, &ti, -1);
+		whos[n++] = ti.who;
+	}
+
+	cur->close(cur);
+
+	if (gz)
+		gzclose(gz);
+
+	if (n) {
+		rcache_invalidate(ds, mtinf, horizon);
+		rollup_invalidate(mtinf, horizon);
+	}
+
+	qsort(whos, n, sizeof(unsigned), unsigned_cmp);
+	for (i = 0; i < n; i++)
+		if (!i || whos[i] != whos[i - 1])
+			hist_expire(dbs, whos[i], horizon);
+
+	free(whos);
+	return n;
+}
+
+/******
+ * cache related functions
+ ******/
+
+/* Without a cache size, BDB uses its tiny default cache and queries keep
+ * reading the same pages from disk. -M and CACHE size the cache (-M can also
+ * split it in many regions), STATS cache shows how well it does, so that it
+ * can be sized from numbers instead of guesswork.
+ */
+
+#define GIGA (1ULL << 30)
+
+/* get a size in bytes from a string such as "512K", "64M" or "2G", returns
+ * 0 if it isn't valid
+ */
+static unsigned long long
+sscansize(char *buf, char **endptr)
+{
+	unsigned long long n;
+
+	errno = 0;
+	n = strtoull(buf, endptr, 10);
+	if (errno || buf == *endptr)
+		return 0;
+
+	switch (**endptr) {
+	case 'G': case 'g': n *= 1024;
+	case 'M': case 'm': n *= 1024;
+	case 'K': case 'k': n *= 1024;
+		(*endptr)++;
+	}
+
+	return n;
+}
+
+/* set the cache size from SIZE[,NCACHE], returns zero or a db error. The
+ * number of regions can only be set before the environment is opened
+ */
+static int
+cache_set(char *arg)
+{
+	unsigned long long size;
+	u_int32_t gbytes, bytes;
+	int ncache;
+	char *end;
+
+	size = sscansize(arg, &end);
+	if (!size)
+		return EINVAL;
+
+	CBUG(dbe->get_cachesize(dbe, &gbytes, &bytes, &ncache));
+
+	if (*end == ',') {
+		char *aux = end + 1;
+		ncache = strtol(aux, &end, 10);
+		if (ncache <= 0 || aux == end)
+			return EINVAL;
+	}
+
+	if (*end)
+		return EINVAL;
+
+	return dbe->set_cachesize(dbe, size / GIGA, size % GIGA, ncache);
+}
+
+/* go through the max index of a dataset, so its pages are in the cache
+ * before the first queries need them
+ */
+static void
+cache_load(struct tidbs *dbs)
+{
+	DB_ITER(dbs->max)
+		; // reading them is enough
+}
+
+/* print the page count of a db */
+static void
+cache_db_print(FILE *out, char *name, DB *db, int hash)
+{
+	u_int32_t pages;
+
+	if (hash) {
+		DB_HASH_STAT *sp;
+		CBUG(db->stat(db, NULL, &sp, DB_FAST_STAT));
+		pages = sp->hash_pagecnt;
+		free(sp);
+	} else {
+		DB_BTREE_STAT *sp;
+		CBUG(db->stat(db, NULL, &sp, DB_FAST_STAT));
+		pages = sp->bt_pagecnt;
+		free(sp);
+	}
+
+	fprintf(out, "db %s pages %u\n", name, pages);
+}
+
+/* print the cache statistics (and the sizes of the dbs of the dataset) */
+static void
+cache_print(FILE *out)
+{
+	DB_MPOOL_STAT *gsp;
+	DB_MPOOL_FSTAT **fsp, **f;
+	uintmax_t hit, miss;
+
+	CBUG(dbe->memp_stat(dbe, &gsp, &fsp, 0));
+
+	hit = gsp->st_cache_hit;
+	miss = gsp->st_cache_miss;
+
+	fprintf(out, "size %ju ncache %u pages %u\n",
+			(uintmax_t) (gsp->st_gbytes * GIGA + gsp->st_bytes),
+			(unsigned) gsp->st_ncache, (unsigned) gsp->st_pages);
+	fprintf(out, "hits %ju misses %ju ratio %.1f%%\n", hit, miss,
+			hit + miss ? 100.0 * hit / (hit + miss) : 0.0);
+	fprintf(out, "pages in %ju out %ju evicted clean %ju dirty %ju\n",
+			(uintmax_t) gsp->st_page_in,
+			(uintmax_t) gsp->st_page_out,
+			(uintmax_t) gsp->st_ro_evict,
+			(uintmax_t) gsp->st_rw_evict);
+
+	for (f = fsp; f && *f; f++)
+		fprintf(out, "file %s hits %ju misses %ju in %ju out %ju\n",
+				(*f)->file_name,
+				(uintmax_t) (*f)->st_cache_hit,
+				(uintmax_t) (*f)->st_cache_miss,
+				(uintmax_t) (*f)->st_page_in,
+				(uintmax_t) (*f)->st_page_out);
+
+	free(gsp);
+	free(fsp);
+
+	cache_db_print(out, "g", ds->gdb, 1);
+	cache_db_print(out, "ti", ds->pdbs.ti, 1);
+	cache_db_print(out, "max", ds->pdbs.max, 0);
+	cache_db_print(out, "id", ds->pdbs.id, 0);
+	cache_db_print(out, "hist", ds->pdbs.hist, 0);
+}
+
+/******
+ * matches related functions
+ ******/
+
+/* makes all provided matches lie within the provided interval [min, max] */
+static inline void
+matches_fix(struct match_stailq *matches, time_t min, time_t max)
+{
+	struct match *match;
+
+	STAILQ_FOREACH(match, matches, entry) {
+		if (match->ti.min < min)
+			match->ti.min = min;
+		if (match->ti.max > max)
+			match->ti.max = max;
+	}
+}
+
+static void
+matches_free(struct match_stailq *matches)
+{
+	struct match *match, *match_tmp;
+
+	STAILQ_FOREACH_SAFE(match, matches, entry, match_tmp) {
+		STAILQ_REMOVE_HEAD(matches, entry);
+		free(match);
+	}
+}
+
+/******
+ * isplit related functions
+ ******/
+
+/* compares isplits, so that we can sort them */
+static int
+isplit_cmp(const void *ap, const void *bp)
+{
+	struct isplit a, b;
+	memcpy(&a, ap, sizeof(struct isplit));
+	memcpy(&b, bp, sizeof(struct isplit));
+	if (b.ts > a.ts)
+		return -1;
+	if (a.ts > b.ts)
+		return 1;
+	if (b.max > a.max)
+		return -1;
+	if (a.max > b.max)
+		return 1;
+	return 0;
+}
+
+// assumes isplits is of size matches_l * 2
+/* creates intermediary isplits */
+static inline struct isplit *
+isplits_create(struct match_stailq *matches, size_t matches_l) {
+	struct isplit *isplits = (struct isplit *) malloc(sizeof(struct isplit) * matches_l * 2);
+	struct match *match;
+	unsigned i = 0;
+
+	STAILQ_FOREACH(match, matches, entry) {
+		struct isplit *isplit = isplits + i * 2;
+		isplit->ts = match->ti.min;
+		isplit->max = 0;
+		isplit->who = match->ti.who;
+		isplit++;
+		isplit->ts = match->ti.max;
+		isplit->max = 1;
+		isplit->who = match->ti.who;
+		i ++;
+	};
+
+	return isplits;
+}
+
+/* gets the (sorted) isplits of the intervals that intersect [min, max],
+ * clipping them to it if fix is set. Returns how many there are
+ */
+static size_t
+isplits_get(struct isplit **isplits, time_t min, time_t max, int fix)
+{
+	struct match_stailq matches;
+	size_t matches_l = ti_intersect(&ds->pdbs, &matches, min, max);
+
+	if (fix)
+		matches_fix(&matches, min, max);
+
+	*isplits = isplits_create(&matches, matches_l);
+	qsort(*isplits, matches_l * 2, sizeof(struct isplit), isplit_cmp);
+	matches_free(&matches);
+	return matches_l * 2;
+}
+
+/* Goes through the isplits (clipped to [min, max] and sorted) keeping only
+ * a count of how many intervals are open, calling cb for each stretch of
+ * [min, max) in which that count doesn't change.
+ */
+static void
+isplits_walk(struct isplit *isplits, size_t n, time_t min, time_t max,
+		void (*cb)(time_t, time_t, int, void *), void *arg)
+{
+	time_t t = min, next;
+	size_t i = 0;
+	int cur = 0;
+
+	while (t < max) {
+		for (; i < n && isplits[i].ts <= t; i++)
+			cur += isplits[i].max ? -1 : 1;
+
+		next = i < n && isplits[i].ts < max ? isplits[i].ts : max;
+		cb(t, next, cur, arg);
+		t = next;
+	}
+}
+
+/* Puts the isplits of each group (at a level) together, keeping their
+ * order, so that each group can be walked like all of them. The isplits of
+ * the group led by g end up from off[g] to off[g + 1]. Returns off.
+ */
+static size_t *
+isplits_group(struct isplit *isplits, size_t n, unsigned level)
+{
+	unsigned ids = ids_len(), g;
+	size_t *off = (size_t *) calloc(ids + 1, sizeof(size_t)), i, sum = 0;
+	struct isplit *copy = (struct isplit *) malloc(sizeof(struct isplit) * n);
+
+	memcpy(copy, isplits, sizeof(struct isplit) * n);
+
+	for (i = 0; i < n; i++)
+		off[group_of(copy[i].who, level)]++;
+
+	for (g = 0; g <= ids; g++) {
+		size_t count = off[g];
+		off[g] = sum;
+		sum += count;
+	}
+
+	for (i = 0; i < n; i++)
+		isplits[off[group_of(copy[i].who, level)]++] = copy[i];
+
+	// each off[g] is now where the next group starts
+	memmove(off + 1, off, sizeof(size_t) * ids);
+	off[0] = 0;
+	free(copy);
+	return off;
+}
+
+/* compares probes by timestamp, so that we can sort them */
+static int
+probe_cmp(const void *ap, const void *bp)
+{
+	const struct probe *a = ap, *b = bp;
+	return b->ts > a->ts ? -1 : (a->ts > b->ts ? 1 : 0);
+}
+
+/* The people present at some point of a sweep over isplits: count has how
+ * many of their intervals are open, and present lists those with any (pos
+ * being where in it they are).
+ */
+struct presence {
+	unsigned *count, *pos, *present;
+	size_t len;
+};
+
+static void
+presence_init(struct presence *p)
+{
+	unsigned ids = ids_len();
+
+	p->count = (unsigned *) calloc(ids, sizeof(unsigned));
+	p->pos = (unsigned *) malloc(sizeof(unsigned) * ids);
+	p->present = (unsigned *) malloc(sizeof(unsigned) * ids);
+	p->len = 0;
+}
+
+/* apply an isplit (someone coming or going) */
+static inline void
+presence_apply(struct presence *p, struct isplit *isplit)
+{
+	unsigned who = isplit->who;
+
+	if (!isplit->max) {
+		if (!p->count[who]++) {
+			p->pos[who] = p->len;
+			p->present[p->len++] = who;
+		}
+	} else if (!--p->count[who]) {
+		unsigned last = p->present[--p->len];
+		p->present[p->pos[who]] = last;
+		p->pos[last] = p->pos[who];
+	}
+}
+
+static void
+presence_free(struct presence *p)
+{
+	free(p->present);
+	free(p->pos);
+	free(p->count);
+}
+
+/* Goes through the isplits (sorted by isplit_cmp) and the probes (sorted by
+ * probe_cmp) together, keeping track of who is present (has an interval with
+ * min <= ts < max). For each probe, cb gets the ids present at its time. So
+ * many point queries only take one pass over the intervals.
+ */
+static void
+isplits_sweep(struct isplit *isplits, size_t isplits_l,
+		struct probe *probes, size_t probes_l,
+		void (*cb)(struct probe *, unsigned *, size_t, void *),
+		void *arg)
+{
+	struct presence p;
+	size_t i = 0, j;
+
+	presence_init(&p);
+
+	for (j = 0; j < probes_l; j++) {
+		for (; i < isplits_l && isplits[i].ts <= probes[j].ts; i++)
+			presence_apply(&p, &isplits[i]);
+
+		cb(&probes[j], p.present, p.len, arg);
+	}
+
+	presence_free(&p);
+}
+
+/******
+ * rollup related functions
+ ******/
+
+/* Summaries of each rollup_secs (a day, by default) of a dataset: how many
+ * people were present, for how many seconds in total, and at most at once.
+ * They are kept in the rollup db, keyed by the start of their bucket, so
+ * that queries over long ranges read one record per bucket. Only buckets
+ * that are over are kept. Changes to intervals delete the ones they overlap
+ * (see rollup_invalidate), and they are computed again when needed, or when
+ * we are idle. "itd -U" builds them all again.
+ */
+
+struct rollup {
+	time_t secs; // bucket size it was computed with
+	unsigned ids, peak;
+	time_t total;
+};
+
+time_t rollup_secs = 86400;
+
+/* the start of the bucket of a timestamp */
+static inline time_t
+rollup_bucket(time_t ts)
+{
+	return ts - ((ts % rollup_secs) + rollup_secs) % rollup_secs;
+}
+
+/* delete the rollups of the buckets that overlap [min, max] */
+static void
+rollup_invalidate(time_t min, time_t max)
+{
+	DBC *cur;
+	DBT key, data;
+	time_t start = min == mtinf ? mtinf : rollup_bucket(min);
+	int res, flags = min == mtinf ? DB_FIRST : DB_SET_RANGE;
+
+	if (snap.base)
+		return;
+
+	memset(&key, 0, sizeof(DBT));
+	memset(&data, 0, sizeof(DBT));
+	key.data = &start;
+	key.size = sizeof(start);
+
+	CBUG(ds->rollup->cursor(ds->rollup, NULL, &cur, 0));
+
+	while ((res = cur->c_get(cur, &key, &data, flags)) != DB_NOTFOUND) {
+		time_t bucket;
+
+		CBUG(res);
+		flags = DB_NEXT;
+		memcpy(&bucket, key.data, sizeof(bucket));
+
+		if (bucket > max)
+			break;
+
+		CBUG(cur->c_del(cur, 0));
+	}
+
+	cur->close(cur);
+}
+
+/* the most that were present at once in each bucket, from isplits_walk */
+struct rollup_walk {
+	struct rollup *rs;
+	time_t start;
+};
+
+static void
+rollup_peak(time_t from, time_t to, int count, void *arg)
+{
+	struct rollup_walk *w = arg;
+	size_t k = (from - w->start) / rollup_secs,
+	       last = (to - 1 - w->start) / rollup_secs;
+
+	for (; k <= last; k++)
+		if (count > (int) w->rs[k].peak)
+			w->rs[k].peak = count;
+}
+
+/* compute the n rollups from start on, in one pass over their intervals */
+static void
+rollup_compute(time_t start, size_t n, struct rollup *rs)
+{
+	time_t end = start + n * rollup_secs;
+	struct match_stailq matches;
+	struct match *match;
+	struct rollup_walk w = { .rs = rs, .start = start };
+	struct isplit *isplits;
+	struct ti *tis;
+	unsigned ids = ids_len();
+	size_t *seen = (size_t *) malloc(sizeof(size_t) * ids);
+	size_t tis_l, i = 0, k;
+
+	memset(rs, 0, sizeof(struct rollup) * n);
+	for (k = 0; k < n; k++)
+		rs[k].secs = rollup_secs;
+
+	tis_l = ti_intersect(&ds->pdbs, &matches, start, end);
+	matches_fix(&matches, start, end);
+	isplits = isplits_create(&matches, tis_l);
+	qsort(isplits, tis_l * 2, sizeof(struct isplit), isplit_cmp);
+	isplits_walk(isplits, tis_l * 2, start, end, rollup_peak, &w);
+	free(isplits);
+
+	tis = (struct ti *) malloc(sizeof(struct ti) * tis_l);
+	STAILQ_FOREACH(match, &matches, entry)
+		tis[i++] = match->ti;
+	matches_free(&matches);
+
+	// in order of min, so that each person is counted once per bucket
+	qsort(tis, tis_l, sizeof(struct ti), ti_min_cmp);
+	memset(seen, 0xff, sizeof(size_t) * ids);
+
+	for (i = 0; i < tis_l; i++) {
+		struct ti *ti = &tis[i];
+		size_t last;
+
+		if (ti->max <= ti->min)
+			continue;
+
+		k = (ti->min - start) / rollup_secs;
+		last = (ti->max - 1 - start) / rollup_secs;
+
+		for (; k <= last; k++) {
+			time_t bmin = start + k * rollup_secs,
+			       bmax = bmin + rollup_secs;
+
+			rs[k].total += (ti->max < bmax ? ti->max : bmax)
+				- (ti->min > bmin ? ti->min : bmin);
+
+			if (seen[ti->who] == (size_t) -1 || seen[ti->who] < k) {
+				seen[ti->who] = k;
+				rs[k].ids++;
+			}
+		}
+	}
+
+	free(tis);
+	free(seen);
+}
+
+/* does the db have the rollup of a bucket (that is over)? */
+static int
+rollup_read(time_t bucket, struct rollup *r)
+{
+	DBT key, data;
+
+	if (snap.base || bucket + rollup_secs > time(NULL))
+		return 0;
+
+	memset(&key, 0, sizeof(DBT));
+	memset(&data, 0, sizeof(DBT));
+	key.data = &bucket;
+	key.size = sizeof(bucket);
+
+	if (ds->rollup->get(ds->rollup, NULL, &key, &data, 0))
+		return 0;
+
+	memcpy(r, data.data, sizeof(struct rollup));
+	return r->secs == rollup_secs;
+}
+
+/* get the n rollups from start on. Those that are kept are read, and each
+ * run of the others is computed (keeping those of buckets that are over).
+ * Queries with ONLY always compute theirs, since only those of everybody
+ * are kept
+ */
+static void
+rollup_get(time_t start, size_t n, struct rollup *rs)
+{
+	time_t now = time(NULL);
+	DBT key, data;
+	size_t k, run;
+
+	if (qfilter) {
+		rollup_compute(start, n, rs);
+		return;
+	}
+
+	memset(&key, 0, sizeof(DBT));
+	memset(&data, 0, sizeof(DBT));
+
+	for (k = 0; k < n; k = run) {
+		if (rollup_read(start + k * rollup_secs, &rs[k])) {
+			run = k + 1;
+			continue;
+		}
+
+		for (run = k + 1; run < n
+				&& !rollup_read(start + run * rollup_secs, &rs[run]);
+				run++);
+
+		rollup_compute(start + k * rollup_secs, run - k, rs + k);
+
+		for (; k < run && !snap.base; k++) {
+			time_t bucket = start + k * rollup_secs;
+
+			if (bucket + rollup_secs > now)
+				break;
+
+			key.data = &bucket;
+			key.size = sizeof(bucket);
+			data.data = &rs[k];
+			data.size = sizeof(struct rollup);
+			CBUG(ds->rollup->put(ds->rollup, NULL, &key, &data, 0));
+		}
+	}
+}
+
+/* make sure the last bucket that is over has its rollup */
+static void
+rollup_some(void)
+{
+	struct rollup r;
+
+	rollup_get(rollup_bucket(time(NULL)) - rollup_secs, 1, &r);
+}
+
+/* build all rollups again, from the first interval until now */
+static void
+rollup_rebuild(void)
+{
+	time_t first = tinf, start;
+	struct rollup *rs;
+	size_t n;
+
+	rollup_invalidate(mtinf, tinf);
+
+	{
+		DB_ITER(ds->pdbs.ti) {
+			struct ti ti;
+			memcpy(&ti, data.data, sizeof(ti));
+			if (ti.min != mtinf && ti.min < first)
+				first = ti.min;
+		}
+	}
+
+	if (first == tinf)
+		return;
+
+	start = rollup_bucket(first);
+	n = (rollup_bucket(time(NULL)) - start) / rollup_secs;
+	rs = (struct rollup *) malloc(sizeof(struct rollup) * (n ? n : 1));
+	rollup_get(start, n, rs);
+	free(rs);
+}
+
+/******
+ * split related functions
+ ******/
+
+/* Creates one split from its interval, and the list of people that are present
+ */
+static inline struct split *
+split_create(uint64_t *who, size_t n, time_t min, time_t max)
+{
+	struct split *split = (struct split *) malloc(sizeof(struct split));
+	split->min = min;
+	split->max = max;
+	split->who = bs_create();
+	memcpy(split->who, who, n * sizeof(uint64_t));
+	split->count = bs_count(who, n);
+	return split;
+}
+
+/* Creates splits from the intermediary isplit array */
+static inline void
+splits_create(
+		struct split_tailq *splits,
+		struct isplit *isplits,
+		size_t matches_l)
+{
+	size_t n = bs_len();
+	uint64_t *who = bs_create();
+	int i;
+
+	TAILQ_INIT(splits);
+
+	for (i = 0; i + 1 < matches_l * 2; i++) {
+		struct isplit *isplit = isplits + i;
+		struct isplit *isplit2 = isplits + i + 1;
+		struct split *split;
+		time_t min, max;
+
+		if (isplit->max)
+			bs_clear(who, isplit->who);
+		else
+			bs_set(who, isplit->who);
+
+		min = isplit->ts;
+		max = isplit2->ts;
+
+		if (min == max)
+			continue;
+
+		split = split_create(who, n, min, max);
+		TAILQ_INSERT_TAIL(splits, split, entry);
+	}
+	free(who);
+}
+
+/* From a list of matched intervals, this creates the tail queue of splits
+ */
+static void
+splits_init(struct split_tailq *splits, struct match_stailq *matches, unsigned matches_l)
+{
+	struct isplit *isplits;
+	struct isplit *isplit;
+	struct isplit *buf;
+	int i = 0;
+
+	isplits = isplits_create(matches, matches_l);
+	qsort(isplits, matches_l * 2, sizeof(struct isplit), isplit_cmp);
+	splits_create(splits, isplits, matches_l);
+	free(isplits);
+}
+
+/* Obtains a tail queue of splits from the intervals that intersect the query
+ * interval [min, max]
+ */
+static void
+splits_get(struct split_tailq *splits, struct tidbs *dbs, time_t min, time_t max)
+{
+	struct match_stailq matches;
+	unsigned matches_l = ti_intersect(dbs, &matches, min, max);
+	matches_fix(&matches, min, max);
+	splits_init(splits, &matches, matches_l);
+	matches_free(&matches);
+}
+
+/* Inserts a tail queue of splits within another, before the element provided
+ */
+static inline void
+splits_concat_before(
+		struct split_tailq *target,
+		struct split_tailq *origin,
+		struct split *before)
+{
+	struct split *split, *tmp;
+	TAILQ_FOREACH_SAFE(split, origin, entry, tmp) {
+		TAILQ_REMOVE(origin, split, entry);
+		TAILQ_INSERT_BEFORE(before, split, entry);
+	}
+}
+
+/* Fills the spaces between splits (or on empty splits) with splits from BST B,
+ * in order to resolve the situation where none of the people are present for
+ * periods of time within the billing period (the aforementined gaps).
+ */
+static inline void
+splits_fill(struct split_tailq *splits, time_t min, time_t max)
+{
+	struct split *split, *tmp;
+	struct split_tailq more_splits;
+	time_t last_max;
+
+	split = TAILQ_FIRST(splits);
+	if (!split) {
+		splits_get(splits, &ds->pdbs, min, max);
+		return;
+	}
+
+	last_max = min;
+
+	if (split->min > last_max) {
+		struct split_tailq more_splits;
+		splits_get(&more_splits, &ds->pdbs, last_max, split->min);
+		splits_concat_before(splits, &more_splits, split);
+	}
+
+	last_max = split->max;
+
+	TAILQ_FOREACH_SAFE(split, splits, entry, tmp) {
+		if (!split->count) {
+			struct split_tailq more_splits;
+			splits_get(&more_splits, &ds->pdbs, split->min, split->max);
+			splits_concat_before(splits, &more_splits, split);
+			TAILQ_REMOVE(splits, split, entry);
+		}
+
+		last_max = split->max;
+	}
+
+	if (max > last_max) {
+		struct split_tailq more_splits;
+		splits_get(&more_splits, &ds->pdbs, last_max, max);
+		TAILQ_CONCAT(splits, &more_splits, entry);
+	}
+}
+
+/* adds debt for each person of the tail queue of splits to the payer of the
+ * bill
+ */
+static inline void
+splits_print(struct split_tailq *splits)
+{
+	struct split *split;
+
+	TAILQ_FOREACH(split, splits, entry) {
+		time_t interval = split->max - split->min;
+		printf("%ld", interval);
+		BS_FOREACH(who, split->who, bs_len())
+			printf(" %s", gi_get(who));
+		printf("\n");
+	}
+}
+
+/* Frees a tail queue of splits */
+static void
+splits_free(struct split_tailq *splits)
+{
+	struct split *split, *split_tmp;
+
+	TAILQ_FOREACH_SAFE(split, splits, entry, split_tmp) {
+		free(split->who);
+		TAILQ_REMOVE(splits, split, entry);
+		free(split);
+	}
+}
+
+/******
+ * connection related functions
+ ******/
+
+/* Connections don't block, so that one that is slow to read its replies (or
+ * that stays open to WATCH) doesn't hold up the others. What can't be
+ * written to it right away is kept in its out buffer, and sent as soon as it
+ * can take more (see conn_flush).
+ */
+static void
+conn_write(int fd, char *buf, size_t len)
+{
+	struct conn *c = &conns[fd];
+	ssize_t ret = 0;
+
+	if (!c->out_len) {
+		ret = write(fd, buf, len);
+		if (ret < 0 && errno != EAGAIN)
+			return; // it is gone, reading from it will tell
+		if (ret < 0)
+			ret = 0;
+	}
+
+	if ((size_t) ret == len)
+		return;
+
+	c->out = realloc(c->out, c->out_len + len - ret);
+	CBUG(!c->out);
+	memcpy(c->out + c->out_len, buf + ret, len - ret);
+	c->out_len += len - ret;
+	FD_SET(fd, &fds_pending);
+
+	// stop reading what would make it grow, until it is sent
+	if (c->out_len > CONN_OUT)
+		FD_CLR(fd, &fds_active);
+}
+
+/* send what we can of the out buffer, returns -1 if the connection is gone */
+static int
+conn_flush(int fd)
+{
+	struct conn *c = &conns[fd];
+	ssize_t ret = write(fd, c->out, c->out_len);
+
+	if (ret < 0)
+		return errno == EAGAIN ? 0 : -1;
+
+	c->out_len -= ret;
+	memmove(c->out, c->out + ret, c->out_len);
+
+	if (c->out_len <= CONN_OUT && !c->eof)
+		FD_SET(fd, &fds_active);
+
+	if (c->out_len)
+		return 0;
+
+	FD_CLR(fd, &fds_pending);
+	return c->eof ? -1 : 0;
+}
+
+static void
+conn_close(int fd)
+{
+	struct conn *c = &conns[fd];
+
+	shutdown(fd, 2);
+	close(fd);
+	FD_CLR(fd, &fds_active);
+	FD_CLR(fd, &fds_read);
+	FD_CLR(fd, &fds_write);
+	FD_CLR(fd, &fds_pending);
+
+	if (c->watch)
+		watchers--;
+
+	if (c->join)
+		join_free(c->join);
+
+	free(c->watch);
+	free(c->in);
+	free(c->out);
+	memset(c, 0, sizeof(struct conn));
+}
+
+/******
+ * watch related functions
+ ******/
+
+/* does a name match a list of names and prefixes (as in ONLY), or is the
+ * list empty?
+ */
+static int
+watch_match(char *list, char *name)
+{
+	size_t len;
+
+	if (!*list)
+		return 1;
+
+	for (; *list; list += len + !!list[len]) {
+		len = strcspn(list, ",");
+
+		if (len && list[len - 1] == '*'
+				? !strncmp(list, name, len - 1)
+				: !strncmp(list, name, len) && !name[len])
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Write the open intervals of the current dataset whose ids match list, as
+ * "+ DATE ID" lines (DATE is when they started)
+ */
+static void
+watch_open(FILE *out, char *list)
+{
+	struct tidbs *dbs = &ds->pdbs;
+	char date[DATE_MAX_LEN];
+	time_t key_ts = tinf;
+	struct ti ti;
+	DBT key, data;
+	DBC *cur;
+	size_t i;
+	int res, dbflags = DB_SET;
+
+	if (snap.base) {
+		// open intervals are at the end of by_max
+		for (i = snap.head->count; i && snap.by_max[i - 1].max == tinf; i--);
+
+		for (; i < snap.head->count; i++) {
+			ti = snap.by_max[i];
+			if (watch_match(list, gi_get(ti.who)))
+				fprintf(out, "+ %s %s\n", printtime_r(date, ti.min),
+						gi_get(ti.who));
+		}
+
+		return;
+	}
+
+	CBUG(dbs->max->cursor(dbs->max, NULL, &cur, 0));
+	memset(&key, 0, sizeof(DBT));
+	memset(&data, 0, sizeof(DBT));
+	key.data = &key_ts;
+	key.size = sizeof(time_t);
+
+	while ((res = cur->c_get(cur, &key, &data, dbflags)) != DB_NOTFOUND) {
+		CBUG(res);
+		dbflags = DB_NEXT_DUP;
+		memcpy(&ti, data.data, sizeof(ti));
+
+		if (mt_end(dbs, ti.who, ti.min) == tinf
+				&& watch_match(list, gi_get(ti.who)))
+			fprintf(out, "+ %s %s\n", printtime_r(date, ti.min),
+					gi_get(ti.who));
+	}
+
+	cur->close(cur);
+
+	for (i = 0; i < dbs->mt_len; i++) {
+		struct mt_ent *ent = &dbs->mt[i];
+
+		if (!ent->finish && ent->ti.max == tinf
+				&& watch_match(list, gi_get(ent->ti.who)))
+			fprintf(out, "+ %s %s\n", printtime_r(date, ent->ti.min),
+					gi_get(ent->ti.who));
+	}
+}
+
+/* Tell those who WATCH id (in the current dataset) that it entered ('+') or
+ * left ('-') at ts. A watcher that falls too far behind is disconnected,
+ * rather than having its backlog grow without bound.
+ */
+static void
+watch_notify(char sign, time_t ts, unsigned id)
+{
+	char buf[DATE_MAX_LEN + USERNAME_MAX_LEN + 4], date[DATE_MAX_LEN];
+	struct tz *tz = qtz;
+	char *name;
+	int fd, len;
+
+	if (!watchers)
+		return;
+
+	name = gi_get(id);
+
+	for (fd = 0; fd < FD_SETSIZE; fd++) {
+		struct conn *c = &conns[fd];
+
+		if (!c->watch || c->wds != ds || !watch_match(c->watch, name))
+			continue;
+
+		if (c->out_len > WATCH_BACKLOG) {
+			free(c->watch);
+			c->watch = NULL;
+			watchers--;
+			shutdown(fd, 2); // its next read or write will close it
+			continue;
+		}
+
+		qtz = c->wtz;
+		len = snprintf(buf, sizeof(buf), "%c %s %s\n", sign,
+				printtime_r(date, ts), name);
+		conn_write(fd, buf, len);
+	}
+
+	qtz = tz;
+}
+
+/******
+ * join related functions
+ ******/
+
+/* After JOIN, a connection sends rows that start with a date, ending them
+ * with "EOF". Each row is answered with itself, a tab, and who was present
+ * at its date. Rows are kept until there are JOIN_CHUNK of them, and then
+ * answered in a single sweep (see isplits_sweep) over the intervals between
+ * the first and the last of their dates, in the order they came in. So a
+ * stream of any length is joined in bounded memory, and a sorted one in
+ * short sweeps.
+ */
+struct join {
+	char *rows[JOIN_CHUNK];
+	size_t n;
+	uint64_t *filter; // of its ONLY
+	struct tz *tz; // of its TZ
+};
+
+/* keep the names present at the date of a row, in its place */
+static void
+join_collect(struct probe *probe, unsigned *present, size_t present_l,
+		void *arg)
+{
+	char **bufs = arg;
+	size_t len, i;
+	FILE *out = open_memstream(&bufs[probe->pos], &len);
+
+	CBUG(!out);
+
+	for (i = 0; i < present_l; i++)
+		fprintf(out, i ? " %s" : "%s", gi_get(present[i]));
+
+	fclose(out);
+}
+
+/* answer the rows of a connection's JOIN that are kept */
+static void
+join_flush(int fd)
+{
+	struct join *join = conns[fd].join;
+	struct probe probes[JOIN_CHUNK];
+	struct isplit *isplits;
+	struct tz *tz = qtz;
+	uint64_t *filter = qfilter;
+	char *bufs[JOIN_CHUNK], *buf = NULL, date[DATE_MAX_LEN];
+	size_t isplits_l, len = 0, n = 0, i;
+	FILE *out;
+
+	if (!join->n)
+		return;
+
+	qtz = join->tz;
+	qfilter = join->filter;
+
+	// rows without a date (like the header of a file) get "# error"
+	for (i = 0; i < join->n; i++) {
+		read_word(date, join->rows[i], sizeof(date) - 1);
+		if (read_time(&probes[n].ts, date))
+			continue;
+		probes[n++].pos = i;
+	}
+
+	memset(bufs, 0, sizeof(bufs));
+
+	if (n) {
+		qsort(probes, n, sizeof(struct probe), probe_cmp);
+		isplits_l = isplits_get(&isplits, probes[0].ts,
+				probes[n - 1].ts, 0);
+		isplits_sweep(isplits, isplits_l, probes, n, join_collect, bufs);
+		free(isplits);
+	}
+
+	out = open_memstream(&buf, &len);
+	CBUG(!out);
+
+	for (i = 0; i < join->n; i++) {
+		fprintf(out, "%s\t%s\n", join->rows[i],
+				bufs[i] ? bufs[i] : "# error");
+		free(bufs[i]);
+		free(join->rows[i]);
+	}
+
+	fclose(out);
+	conn_write(fd, buf, len);
+	free(buf);
+	join->n = 0;
+	qtz = tz;
+	qfilter = filter;
+}
+
+/* a row of a JOIN, or the "EOF" after them */
+static void
+join_row(int fd, char *line)
+{
+	struct join *join = conns[fd].join;
+
+	if (!strcmp(line, "EOF")) {
+		join_flush(fd);
+		conn_write(fd, "# end\n", 6);
+		join_free(join);
+		conns[fd].join = NULL;
+		return;
+	}
+
+	if (line_empty(line))
+		return;
+
+	join->rows[join->n++] = strdup(line);
+
+	if (join->n == JOIN_CHUNK)
+		join_flush(fd);
+}
+
+static void
+join_free(struct join *join)
+{
+	size_t i;
+
+	for (i = 0; i < join->n; i++)
+		free(join->rows[i]);
+
+	free(join->filter);
+	free(join);
+}
+
+/******
+ * functions that process a valid type of line
+ ******/
+
+/* This function is for handling lines in the format:
+ *
+ * STOP <DATE> <PERSON_ID>
+ *
+ * It reads a PERSON_ID, and it checks if there is a correspondant graph node
+ * (and so a numeric id). If there is one, it finishes the last intervals in
+ * both BSTs (much like process_pause does for BST A). If there isn't a graph
+ * node for that user (and therefore no numeric id), it generates one. Then it
+ * inserts the time interval [-∞, DATE] (and the newly created id) into both
+ * BSTs.
+ */
+static inline void
+process_stop(time_t ts, char *line)
+{
+	char username[USERNAME_MAX_LEN];
+	unsigned id;
+
+	line += read_word(username, line, sizeof(username));
+	id = g_find(username);
+
+	if (id != g_notfound) {
+		if (ti_present(&ds->pdbs, ts, id)) {
+			mt_finish(&ds->pdbs, id, ts);
+			rcache_invalidate(ds, ts, tinf);
+			rollup_invalidate(ts, tinf);
+			watch_notify('-', ts, id);
+		}
+	} else {
+		id = g_insert(username);
+		mt_insert(&ds->pdbs, id, mtinf, ts);
+		rcache_invalidate(ds, mtinf, ts);
+		rollup_invalidate(mtinf, ts);
+	}
+}
+
+/* This function is for handling lines in the format:
+ *
+ * START <DATE> <PERSON_ID> [<PHONE_NUMBER> <EMAIL> ... <NAME>]
+ *
+ * So it reads a textual person id, then it inserts it into the graph as a
+ * node, generating a numeric id. Then it inserts the time interval [DATE, +∞]
+ * along with that numeric id into both BST A and BST B.
+ */
+static inline void
+process_start(time_t ts, char *line)
+{
+	char username[USERNAME_MAX_LEN];
+	unsigned id;
+
+	line += read_word(username, line, sizeof(username));
+	id = g_find(username);
+	if (id == g_notfound)
+		id = g_insert(username);
+	if (!ti_present(&ds->pdbs, ts, id)) {
+		mt_insert(&ds->pdbs, id, ts, tinf);
+		rcache_invalidate(ds, ts, tinf);
+		rollup_invalidate(ts, tinf);
+		watch_notify('+', ts, id);
+	}
+}
+
+/* USE switches the dataset that the following lines are about */
+static void
+process_use(char *line)
+{
+	char name[DS_NAME_MAX + 1];
+
+	read_word(name, line, DS_NAME_MAX);
+	ds_use(name);
+}
+
+/******
+ * etc
+ ******/
+
+/* This function is what processes each line. For each of them, it first checks
+ * if it starts with a "#", in other words, if it is totally commented out.
+ * If it is, it ignores this line. If it isn't, it then proceeds to read a
+ * word: the TYPE of operation or event that the line represents. It also reads
+ * the DATE. After this, it checks what the TYPE of operation is. Depending on
+ * that, it does different things. In all valid cases (and for every different
+ * TYPE), it calls a function named process_<TYPE> (lowercase), all of these
+ * functions receive the DATE that was read, and also a pointer to the part of
+ * the line that wasn't read yet.
+ *
+ * Check out the functions in the section above to understand how these work
+ * internally.
+ */
+static void
+process_line(char *line)
+{
+	char op_type_str[9], date_str[DATE_MAX_LEN];
+	time_t ts;
+
+	// snapshots are read-only
+	if (snap.base || line[0] == '#' || line[0] == '\n')
+		return;
+
+	line += read_word(op_type_str, line, sizeof(op_type_str));
+
+	if (!strcmp(op_type_str, "USE"))
+		return process_use(line);
+
+	line += read_ts(&ts, line);
+
+	switch (*op_type_str) {
+	case 'S':
+		if (op_type_str[1] != 'T')
+			goto error;
+
+		switch(op_type_str[2]) {
+		case 'A':
+			return process_start(ts, line);
+		case 'O':
+			return process_stop(ts, line);
+		}
+	}
+
+error:
+	/* err(EXIT_FAILURE, "Invalid format"); */
+}
+
+/******
+ * pagination related functions
+ ******/
+
+/* Replies to point and range queries can be too big to send at once, so
+ * they can be asked for in pages of up to N rows (LIMIT N). A paged reply
+ * ends with "# next TOKEN" if there is more, to be asked for by sending the
+ * query again with "AFTER TOKEN" (on any connection), or with "# end". The
+ * token says where the page stopped: the kind of query, a key (a max in the
+ * max index, or a split boundary) and a position (among the duplicates of
+ * the key, in the snapshot, or an id), so nothing is kept between pages.
+ */
+struct page {
+	size_t limit, rows; // limit is 0 if the query isn't paged
+	int paged; // it has LIMIT (even an invalid one), so the reply has an end
+	int after, full; // it has a token, it stopped before the end
+	char kind; // 'p' (point), 'u' (range), 'a' ("+"), 's' ("*")
+	time_t key;
+	unsigned long pos;
+};
+
+static struct page qpage; // of the query being processed
+
+/* read an AFTER token into qpage, returns -1 if it isn't one */
+static int
+page_parse(char *token)
+{
+	unsigned long long key;
+	char kind, end;
+
+	if (sscanf(token, "%c.%llx.%lx%c", &kind, &key, &qpage.pos, &end) != 3
+			|| !strchr("puas", kind))
+		return -1;
+
+	qpage.kind = kind;
+	qpage.key = (time_t) key;
+	qpage.after = 1;
+	return 0;
+}
+
+/* Start paging a reply of some kind. Returns -1 (and says so) if its token
+ * was of another kind
+ */
+static int
+page_start(FILE *out, char kind)
+{
+	if (qpage.after && qpage.kind != kind) {
+		fprintf(out, "# error: invalid token\n");
+		return -1;
+	}
+
+	qpage.kind = kind;
+	return 0;
+}
+
+/* Count a row of the reply. Returns non-zero if the page is already full,
+ * ending it with a token that points to the row (at key and pos)
+ */
+static int
+page_full(FILE *out, time_t key, unsigned long pos)
+{
+	if (!qpage.limit || qpage.rows++ < qpage.limit)
+		return 0;
+
+	fprintf(out, "# next %c.%llx.%lx\n", qpage.kind,
+			(unsigned long long) key, pos);
+	qpage.full = 1;
+	return 1;
+}
+
+/* Who is present at ts, a page at a time. The max index is read from ts on
+ * (or from where the last page stopped), so only a page of the reply is ever
+ * in memory. The memtable is flushed first, because positions in it would
+ * not survive its next flush.
+ */
+static void
+page_point(FILE *out, time_t ts)
+{
+	struct tidbs *dbs = &ds->pdbs;
+	time_t key_ts = ts, last = mtinf;
+	unsigned long dup = 0, i;
+	struct ti tmp;
+	DBC *cur;
+	DBT key, data;
+	int dbflags = DB_SET_RANGE, started = 0;
+
+	if (page_start(out, 'p'))
+		return;
+
+	if (snap.base) {
+		size_t lo = 0, hi = snap.head->count;
+
+		while (lo < hi) {
+			size_t mid = (lo + hi) / 2;
+			if (snap.by_max[mid].max <= ts)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		for (i = qpage.after ? qpage.pos : lo; i < snap.head->count
+				&& snap.min_suffix[i] <= ts; i++) {
+			struct ti *ti = &snap.by_max[i];
+
+			if (ti->min > ts || !ids_has(qfilter, ti->who))
+				continue;
+
+			if (page_full(out, 0, i))
+				return;
+
+			fprintf(out, "%s\n", gi_get(ti->who));
+		}
+
+		return;
+	}
+
+	mt_flush(dbs);
+
+	if (qpage.after)
+		key_ts = qpage.key;
+
+	CBUG(dbs->max->cursor(dbs->max, NULL, &cur, 0));
+	memset(&key, 0, sizeof(DBT));
+	memset(&data, 0, sizeof(DBT));
+	key.data = &key_ts;
+	key.size = sizeof(time_t);
+
+	while (1) {
+		int res = cur->c_get(cur, &key, &data, dbflags);
+		time_t max;
+
+		if (res == DB_NOTFOUND)
+			break;
+
+		CBUG(res);
+		dbflags = DB_NEXT;
+		memcpy(&max, key.data, sizeof(max));
+		dup = started && max == last ? dup + 1 : 0;
+		last = max;
+		started = 1;
+
+		// the duplicates of the key that the last page went through
+		if (qpage.after && max == qpage.key && dup < qpage.pos)
+			continue;
+
+		memcpy(&tmp, data.data, sizeof(struct ti));
+
+		if (tmp.max <= ts || tmp.min > ts || !ids_has(qfilter, tmp.who))
+			continue;
+
+		if (page_full(out, max, dup))
+			break;
+
+		fprintf(out, "%s\n", gi_get(tmp.who));
+	}
+
+	cur->close(cur);
+}
+
+/******
+ * queries (lines that come after "EOF")
+ ******/
+
+/* print the intervals (of one person) that intersect [min, max], returning
+ * the seconds of presence within it (leaving out unbounded intervals)
+ */
+static time_t
+history_print(FILE *out, struct ti *tis, size_t n, time_t min, time_t max)
+{
+	char min_str[DATE_MAX_LEN], max_str[DATE_MAX_LEN];
+	time_t total = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		struct ti *ti = &tis[i];
+		time_t tmin = ti->min < min ? min : ti->min,
+		       tmax = ti->max > max ? max : ti->max;
+
+		if (ti->max <= min || ti->min > max)
+			continue;
+
+		fprintf(out, "%s %s\n", printtime_r(min_str, ti->min),
+				printtime_r(max_str, ti->max));
+
+		if (tmin != mtinf && tmax != tinf)
+			total += tmax - tmin;
+	}
+
+	return total;
+}
+
+/* HISTORY of a range that few intervals end after, through the max index */
+static void
+history_by_time(FILE *out, unsigned who, time_t min, time_t max)
+{
+	struct match_stailq matches;
+	struct match *match;
+	uint64_t *ids = bs_create();
+	struct ti *tis;
+	time_t total;
+	size_t n, i = 0;
+
+	bs_set(ids, who);
+	STAILQ_INIT(&matches);
+	n = ti_intersect_time(&ds->pdbs, &matches, min, max, ids)
+		+ mt_intersect(&ds->pdbs, &matches, min, max, ids);
+
+	tis = (struct ti *) malloc(sizeof(struct ti) * (n + 1));
+	STAILQ_FOREACH(match, &matches, entry)
+		tis[i++] = match->ti;
+	matches_free(&matches);
+
+	qsort(tis, n, sizeof(struct ti), ti_min_cmp);
+	total = history_print(out, tis, n, min, max);
+	fprintf(out, "total %ld\n", (long) total);
+	free(tis);
+	free(ids);
+}
+
+/* This is for queries in the format:
+ *
+ * HISTORY <PERSON_ID> [<MIN> <MAX>]
+ *
+ * It lists the intervals of a person (only those that intersect [MIN, MAX]
+ * if provided), followed by their total presence in seconds. Everything is
+ * read from the hist chunks of that person, so the global indexes aren't
+ * touched, unless the planner finds that fewer intervals end after MIN than
+ * the person has. Without MIN and MAX, the total comes from the chunk
+ * headers.
+ */
+static void
+query_history(FILE *out, char *line)
+{
+	struct ti *tis = NULL;
+	struct hist_key hk;
+	struct hist_head head;
+	time_t min = mtinf, max = tinf, total = 0;
+	unsigned who;
+	size_t n = 0, size = 0, i;
+	int dbflags = DB_SET_RANGE, bounded = 0, changed = 0;
+	DBC *cur;
+	DBT key, data;
+
+	line += read_id(&who, line);
+	if (who == g_notfound) {
+		fprintf(out, "# unknown id\n");
+		return;
+	}
+
+	if (!line_empty(line)) {
+		line += read_ts(&min, line);
+		if (line_empty(line)) {
+			fprintf(out, "# missing max\n");
+			return;
+		}
+		read_ts(&max, line);
+		bounded = 1;
+	}
+
+	if (snap.base) {
+		uint64_t start = snap.id_start[who];
+		total = history_print(out, snap.by_id + start,
+				snap.id_start[who + 1] - start, min, max);
+		fprintf(out, "total %ld\n", total);
+		return;
+	}
+
+	if (bounded) {
+		struct plan plan;
+
+		plan_who(&plan, &ds->pdbs, min, who);
+		if (plan.path == PLAN_TIME) {
+			history_by_time(out, who, min, max);
+			return;
+		}
+	}
+
+	CBUG(ds->pdbs.hist->cursor(ds->pdbs.hist, NULL, &cur, 0));
+
+	memset(&hk, 0, sizeof(hk));
+	memset(&key, 0, sizeof(DBT));
+	memset(&data, 0, sizeof(DBT));
+
+	hk.who = who;
+	hk.min = mtinf;
+	key.data = &hk;
+	key.size = sizeof(hk);
+
+	while (1) {
+		int res = cur->c_get(cur, &key, &data, dbflags);
+
+		if (res == DB_NOTFOUND)
+			break;
+
+		CBUG(res);
+		dbflags = DB_NEXT;
+		memcpy(&hk, key.data, sizeof(hk));
+		memcpy(&head, data.data, sizeof(head));
+
+		if (hk.who != who || hk.min > max)
+			break;
+
+		if (head.last <= min)
+			continue;
+
+		if (n + HIST_CHUNK > size) {
+			size = size ? size * 2 : HIST_CHUNK * 2;
+			tis = (struct ti *) realloc(tis, sizeof(struct ti) * size);
+		}
+
+		n += hist_decode(tis + n, &key, &data);
+		total += head.total;
+	}
+
+	cur->close(cur);
+
+	// merge in what is still in the memtable
+	for (i = 0; i < ds->pdbs.mt_len; i++) {
+		struct mt_ent *ent = &ds->pdbs.mt[i];
+		size_t j;
+
+		if (ent->ti.who != who)
+			continue;
+
+		changed = 1;
+
+		if (ent->finish) {
+			for (j = 0; j < n; j++)
+				if (tis[j].min == ent->ti.min && tis[j].max == tinf)
+					tis[j].max = ent->ti.max;
+			continue;
+		}
+
+		if (n == size) {
+			size = size ? size * 2 : HIST_CHUNK;
+			tis = (struct ti *) realloc(tis, sizeof(struct ti) * size);
+		}
+
+		tis[n++] = ent->ti;
+	}
+
+	if (changed)
+		qsort(tis, n, sizeof(struct ti), ti_min_cmp);
+
+	if (n) {
+		time_t clipped = history_print(out, tis, n, min, max);
+		if (bounded || changed)
+			total = clipped;
+	}
+
+	free(tis);
+	fprintf(out, "total %ld\n", total);
+}
+
+/* This is for queries in the format:
+ *
+ * JOIN
+ *
+ * The lines that come after it are rows to join with who was present at
+ * their dates, until "EOF" (see join_row). ONLY and TZ apply to all rows.
+ */
+static void
+query_join(FILE *out, char *line)
+{
+	struct join *join = calloc(1, sizeof(struct join));
+
+	CBUG(!join);
+	join->filter = qfilter;
+	join->tz = qtz;
+	qfilter = NULL; // it is the JOIN's now
+	qconn->join = join;
+}
+
+/* This is for queries in the format:
+ *
+ * WATCH [<ID>[,<ID>...]]
+ *
+ * It lists who is present (whose last interval is still open) among the
+ * given ids (names, or prefixes ending in "*", as in ONLY), or everyone, and
+ * keeps the connection watching them: from then on, each START and STOP of
+ * theirs that changes who is present is sent to it as it is processed (see
+ * watch_notify), so there is nothing to compute for them.
+ */
+static void
+query_watch(FILE *out, char *line)
+{
+	char *end;
+
+	for (; isspace(*line); line++);
+	for (end = line + strlen(line); end > line && isspace(end[-1]); end--);
+	*end = '\0';
+
+	watch_open(out, line);
+
+	if (!qconn->watch)
+		watchers++;
+
+	free(qconn->watch);
+	qconn->watch = strdup(line);
+	qconn->wds = ds;
+	qconn->wtz = qtz;
+}
+
+/* This is for queries in the format:
+ *
+ * SNAPSHOT <PATH>
+ *
+ * It writes a snapshot of the dbs into PATH (see snap_write).
+ */
+static void
+query_snapshot(FILE *out, char *line)
+{
+	char path[PATH_MAX];
+	long count;
+
+	if (snap.base) {
+		fprintf(out, "# read-only\n");
+		return;
+	}
+
+	read_word(path, line, sizeof(path) - 1);
+	count = snap_write(path);
+
+	if (count < 0)
+		fprintf(out, "# error: %s\n", strerror(errno));
+	else
+		fprintf(out, "%ld\n", count);
+}
+
+/* The people that were present during all of [min, max] (the "+" query).
+ * Instead of going through splits, the intervals that intersect it are
+ * sorted by person and start, and each person's are merged to see if they
+ * cover it all.
+ */
+static void
+query_always(FILE *out, time_t min, time_t max)
+{
+	struct match_stailq matches;
+	struct match *match;
+	struct ti *tis;
+	size_t n = ti_intersect(&ds->pdbs, &matches, min, max), i = 0;
+
+	matches_fix(&matches, min, max);
+	tis = (struct ti *) malloc(sizeof(struct ti) * n);
+	STAILQ_FOREACH(match, &matches, entry)
+		tis[i++] = match->ti;
+	matches_free(&matches);
+
+	qsort(tis, n, sizeof(struct ti), ti_who_cmp);
+
+	for (i = 0; i < n;) {
+		unsigned who = tis[i].who;
+		time_t covered = min; // up to where
+
+		for (; i < n && tis[i].who == who; i++)
+			if (tis[i].min <= covered && tis[i].max > covered)
+				covered = tis[i].max;
+
+		if (covered < max || (qpage.after && who < qpage.pos))
+			continue;
+
+		if (page_full(out, 0, who))
+			break;
+
+		fprintf(out, "%s\n", gi_get(who));
+	}
+
+	free(tis);
+}
+
+/* This is for queries in the formats:
+ *
+ * [*|+] <DATE>
+ * [*|+] <MIN> <MAX>
+ *
+ * With a single DATE, it lists who was present then. With an interval, it
+ * lists who was present in it ("+": the entire time), or the splits of the
+ * interval along with who was present in each of them ("*"). These can be
+ * paged (see page_full).
+ */
+static void
+query_intervals(FILE *out, char *line)
+{
+	int type = 0;
+	char *space;
+	time_t min;
+
+	switch (*line) {
+		case '*':
+			type = 1;
+			line += 2;
+			break;
+		case '+':
+			type = 2;
+			line += 2;
+	}
+
+	fprintf(out, "# %s\n", line);
+	space = strchr(line, ' ');
+	if (read_date(&min, &line)) {
+		fprintf(out, "# error: invalid date\n");
+		return;
+	}
+
+	if (space) {
+		// https://softwareengineering.stackexchange.com/questions/363091/split-overlapping-ranges-into-all-unique-ranges/363096#363096
+
+		time_t max;
+		struct split_tailq splits;
+		struct split *split;
+		size_t n = bs_len();
+
+		if (read_date(&max, &line)) {
+			fprintf(out, "# error: invalid date\n");
+			return;
+		}
+
+		if (page_start(out, "usa"[type]))
+			return;
+
+		if (type == 2)
+			return query_always(out, min, max);
+
+		// splits before the boundary of the token were in the last pages
+		if (type == 1 && qpage.after && qpage.key > min)
+			min = qpage.key;
+
+		splits_get(&splits, &ds->pdbs, min, max);
+		splits_fill(&splits, min, max);
+		if (type == 1) TAILQ_FOREACH(split, &splits, entry) {
+			time_t interval = split->max - split->min;
+
+			if (page_full(out, split->min, 0))
+				break;
+
+			fprintf(out, "%ld", interval);
+			BS_FOREACH(who, split->who, n)
+				fprintf(out, " %s", gi_get(who));
+			fprintf(out, "\n");
+		} else {
+			// union of the splits
+			uint64_t *who = bs_create();
+
+			TAILQ_FOREACH(split, &splits, entry)
+				bs_or(who, split->who, n);
+
+			BS_FOREACH(id, who, n) {
+				if (qpage.after && (unsigned long) id < qpage.pos)
+					continue;
+
+				if (page_full(out, 0, id))
+					break;
+
+				fprintf(out, "%s\n", gi_get(id));
+			}
+
+			free(who);
+		}
+		splits_free(&splits);
+	} else if (qpage.limit)
+		page_point(out, min);
+	else {
+		struct match_stailq matches;
+		struct match *match, *match_tmp;
+		unsigned matches_l = ti_intersect(&ds->pdbs, &matches, min, min);
+		STAILQ_FOREACH_SAFE(match, &matches, entry, match_tmp) {
+			fprintf(out, "%s\n", gi_get(match->ti.who));
+			STAILQ_REMOVE_HEAD(&matches, entry);
+			free(match);
+		}
+	}
+}
+
+/* This is for queries in the format:
+ *
+ * COMPACT
+ *
+ * It compacts the intervals of everybody right away (see compact_id), and
+ * reports on that, and on what the background compaction did so far.
+ */
+static void
+query_compact(FILE *out, char *line)
+{
+	struct compact_stats st;
+	unsigned next = 0;
+
+	if (snap.base) {
+		fprintf(out, "# read-only\n");
+		return;
+	}
+
+	memset(&st, 0, sizeof(st));
+	compact_some(&ds->pdbs, &next, ds->g_len, &st);
+	compact_print(out, "now", &st);
+	compact_print(out, "background", &ds->compact_bg);
+}
+
+/* keep the names present at a probe of a BATCH, in its place */
+static void
+batch_collect(struct probe *probe, unsigned *present, size_t present_l,
+		void *arg)
+{
+	char **bufs = arg;
+	size_t len, i;
+	FILE *out = open_memstream(&bufs[probe->pos], &len);
+
+	CBUG(!out);
+
+	for (i = 0; i < present_l; i++)
+		fprintf(out, "%s\n", gi_get(present[i]));
+
+	fclose(out);
+}
+
+/* Answers many point queries (BATCH TS...), in a single sweep over the
+ * intervals between the first and the last of them (see isplits_sweep).
+ * Results come in the order of the query, each under "# TS". A line with
+ * an invalid date is rejected as a whole.
+ */
+static void
+query_batch(FILE *out, char *line)
+{
+	struct isplit *isplits;
+	struct probe *probes = NULL;
+	char **words = NULL, **bufs, *word, *saveptr;
+	size_t n = 0, isplits_l, i;
+
+	for (word = strtok_r(line, " \t", &saveptr); word;
+			word = strtok_r(NULL, " \t", &saveptr)) {
+		probes = realloc(probes, sizeof(struct probe) * (n + 1));
+		words = realloc(words, sizeof(char *) * (n + 1));
+		if (read_time(&probes[n].ts, word)) {
+			fprintf(out, "# error: invalid date %s\n", word);
+			free(words);
+			free(probes);
+			return;
+		}
+		probes[n].pos = n;
+		words[n++] = word;
+	}
+
+	if (!n)
+		return;
+
+	qsort(probes, n, sizeof(struct probe), probe_cmp);
+
+	isplits_l = isplits_get(&isplits, probes[0].ts, probes[n - 1].ts, 0);
+	bufs = (char **) calloc(n, sizeof(char *));
+	isplits_sweep(isplits, isplits_l, probes, n, batch_collect, bufs);
+
+	for (i = 0; i < n; i++) {
+		fprintf(out, "# %s\n%s", words[i], bufs[i]);
+		free(bufs[i]);
+	}
+
+	free(bufs);
+	free(isplits);
+	free(words);
+	free(probes);
+}
+
+/* A bucket of COUNT, with the least and the most people present in it, and
+ * the sum of (people present * seconds)
+ */
+struct count_bucket {
+	time_t start, end;
+	int lo, hi;
+	double area;
+};
+
+#define COUNT_MAX (1 << 20) // buckets
+
+/* print the COUNT buckets of some sorted (and clipped) isplits */
+static void
+count_print(FILE *out, struct isplit *isplits, size_t n, time_t min,
+		time_t max, time_t step)
+{
+	char date[DATE_MAX_LEN];
+	struct count_bucket b;
+	time_t t, next;
+	size_t i = 0;
+	int cur = 0, fresh = 1;
+
+	b.start = t = min;
+	b.end = tz_add(min, step) < max ? tz_add(min, step) : max;
+	b.area = 0;
+
+	while (t < max) {
+		for (; i < n && isplits[i].ts <= t; i++)
+			cur += isplits[i].max ? -1 : 1;
+
+		if (fresh) {
+			b.lo = b.hi = cur;
+			fresh = 0;
+		} else if (cur < b.lo)
+			b.lo = cur;
+		else if (cur > b.hi)
+			b.hi = cur;
+
+		next = i < n && isplits[i].ts < b.end ? isplits[i].ts : b.end;
+		b.area += (double) cur * (next - t);
+		t = next;
+
+		if (t < b.end)
+			continue;
+
+		fprintf(out, "%s %d %d %.2f\n", printtime_r(date, b.start),
+				b.lo, b.hi, b.area / (b.end - b.start));
+
+		b.start = t;
+		b.end = tz_add(t, step) < max ? tz_add(t, step) : max;
+		b.area = 0;
+		fresh = 1;
+	}
+}
+
+/* Occupancy over time (COUNT MIN MAX STEP [BY LEVEL]): for each STEP (like
+ * 3600 or 1h) from MIN to MAX, how many people were present at least, at
+ * most, and on average (weighted by time). It walks the sorted isplits
+ * keeping a count, so no names are looked up and no splits are built. With
+ * BY, the isplits of each group are walked apart, under a "# GROUP" line.
+ */
+static void
+query_count(FILE *out, char *line)
+{
+	char step_str[32], word[16];
+	struct isplit *isplits;
+	time_t min, max, step;
+	size_t n, *off;
+	unsigned g, ids;
+	int level;
+
+	if (read_date(&min, &line) || read_date(&max, &line)) {
+		fprintf(out, "# error: invalid range\n");
+		return;
+	}
+	line += read_word(step_str, line, sizeof(step_str) - 1);
+	line += read_word(word, line, sizeof(word) - 1);
+	step = read_duration(step_str);
+
+	if (step <= 0 || max <= min || (max - min) / step >= COUNT_MAX) {
+		fprintf(out, "# error: invalid range or step\n");
+		return;
+	}
+
+	if ((level = read_by(word, line)) < 0) {
+		fprintf(out, "# error: expected BY LEVEL\n");
+		return;
+	}
+
+	n = isplits_get(&isplits, min, max, 1);
+
+	if (!level) {
+		count_print(out, isplits, n, min, max, step);
+		free(isplits);
+		return;
+	}
+
+	off = isplits_group(isplits, n, level);
+	for (g = 0, ids = ids_len(); g < ids; g++) {
+		if (off[g] == off[g + 1])
+			continue;
+
+		fprintf(out, "# ");
+		group_print(out, g, level);
+		fprintf(out, "\n");
+		count_print(out, isplits + off[g], off[g + 1] - off[g],
+				min, max, step);
+	}
+
+	free(off);
+	free(isplits);
+}
+
+/* seconds of presence of a person, for DURATION */
+struct duration {
+	unsigned who;
+	time_t total;
+};
+
+/* compares durations, the longest first */
+static int
+duration_cmp(const void *ap, const void *bp)
+{
+	const struct duration *a = ap, *b = bp;
+
+	if (a->total != b->total)
+		return a->total > b->total ? -1 : 1;
+
+	return a->who < b->who ? -1 : (a->who > b->who ? 1 : 0);
+}
+
+/* Seconds each person was present (DURATION MIN MAX [TOP K] [BY LEVEL]).
+ * Intervals are clipped to [MIN, MAX] (like matches_fix) and summed by id,
+ * one line per id in id order, or only the K longest (longest first) with
+ * TOP. With BY, the sums of the ids of each group are added up.
+ */
+static void
+query_duration(FILE *out, char *line)
+{
+	struct match_stailq matches;
+	struct match *match;
+	struct duration *durs;
+	char word[16];
+	time_t min, max;
+	unsigned ids = ids_len(), n = 0, i, top = 0;
+	int level;
+
+	if (read_date(&min, &line) || read_date(&max, &line)) {
+		fprintf(out, "# error: invalid range\n");
+		return;
+	}
+	line += read_word(word, line, sizeof(word) - 1);
+
+	if (!strcmp(word, "TOP")) {
+		top = strtoul(line, &line, 10);
+		line += read_word(word, line, sizeof(word) - 1);
+	}
+
+	if ((level = read_by(word, line)) < 0) {
+		fprintf(out, "# error: expected TOP K or BY LEVEL\n");
+		return;
+	}
+
+	durs = (struct duration *) calloc(ids, sizeof(struct duration));
+	ti_intersect(&ds->pdbs, &matches, min, max);
+	matches_fix(&matches, min, max);
+
+	STAILQ_FOREACH(match, &matches, entry)
+		if (match->ti.who < ids)
+			durs[match->ti.who].total += match->ti.max - match->ti.min;
+
+	matches_free(&matches);
+
+	if (level)
+		for (i = 0; i < ids; i++)
+			if (group_of(i, level) != i) {
+				durs[group_of(i, level)].total += durs[i].total;
+				durs[i].total = 0;
+			}
+
+	for (i = 0; i < ids; i++)
+		if (durs[i].total) {
+			durs[n].who = i;
+			durs[n++].total = durs[i].total;
+		}
+
+	if (top) {
+		qsort(durs, n, sizeof(struct duration), duration_cmp);
+		if (n > top)
+			n = top;
+	}
+
+	for (i = 0; i < n; i++) {
+		group_print(out, durs[i].who, level);
+		fprintf(out, " %ld\n", (long) durs[i].total);
+	}
+
+	free(durs);
+}
+
+/* Pairs of people and how long they were present together, for COPRESENCE.
+ * An open addressing hash table keyed by both ids (the smallest first), that
+ * stops taking new pairs when it has COPRESENCE_MAX of them.
+ */
+#define COPRESENCE_MAX (1 << 18)
+#define COPRESENCE_SIZE (COPRESENCE_MAX * 2)
+
+struct pair {
+	uint64_t key; // 0 if empty, otherwise (a << 32 | b) + 1
+	time_t total;
+};
+
+struct pairs {
+	struct pair *tab;
+	size_t len;
+	int full;
+};
+
+/* add seconds to the time a and b (a < b) were together */
+static void
+pairs_add(struct pairs *pairs, unsigned a, unsigned b, time_t secs)
+{
+	uint64_t key = ((uint64_t) a << 32 | b) + 1;
+	size_t i = (key * 0x9E3779B97F4A7C15ULL) >> 45; // COPRESENCE_SIZE bits
+
+	for (;; i = (i + 1) & (COPRESENCE_SIZE - 1)) {
+		struct pair *pair = &pairs->tab[i];
+
+		if (pair->key == key) {
+			pair->total += secs;
+			return;
+		}
+
+		if (pair->key)
+			continue;
+
+		if (pairs->len == COPRESENCE_MAX) {
+			pairs->full = 1;
+			return;
+		}
+
+		pair->key = key;
+		pair->total = secs;
+		pairs->len++;
+		return;
+	}
+}
+
+/* compares pairs, the ones together the longest first */
+static int
+pair_cmp(const void *ap, const void *bp)
+{
+	const struct pair *a = ap, *b = bp;
+
+	if (a->total != b->total)
+		return a->total > b->total ? -1 : 1;
+
+	return a->key < b->key ? -1 : (a->key > b->key ? 1 : 0);
+}
+
+/* Who was present together with whom, and for how many seconds
+ * (COPRESENCE MIN MAX [ID]). It sweeps the sorted isplits once, and between
+ * each of them adds the time elapsed to every pair present (or, with ID,
+ * to everybody present along with ID). Longest first.
+ */
+static void
+query_copresence(FILE *out, char *line)
+{
+	char name[USERNAME_MAX_LEN];
+	struct isplit *isplits;
+	struct presence p;
+	struct pairs pairs;
+	time_t min, max, *with = NULL;
+	size_t n, i = 0, j, k;
+	unsigned id = g_notfound;
+
+	if (read_date(&min, &line) || read_date(&max, &line)) {
+		fprintf(out, "# error: invalid range\n");
+		return;
+	}
+	read_word(name, line, sizeof(name) - 1);
+
+	if (*name) {
+		id = g_find(name);
+		if (id == g_notfound) {
+			fprintf(out, "# unknown id\n");
+			return;
+		}
+		with = (time_t *) calloc(ids_len(), sizeof(time_t));
+	} else {
+		pairs.tab = (struct pair *) calloc(COPRESENCE_SIZE, sizeof(struct pair));
+		pairs.len = 0;
+		pairs.full = 0;
+	}
+
+	n = isplits_get(&isplits, min, max, 1);
+	presence_init(&p);
+
+	while (i < n) {
+		time_t t = isplits[i].ts, secs;
+
+		for (; i < n && isplits[i].ts == t; i++)
+			presence_apply(&p, &isplits[i]);
+
+		if (i == n || p.len < 2)
+			continue;
+
+		secs = isplits[i].ts - t;
+
+		if (with) {
+			if (p.count[id])
+				for (j = 0; j < p.len; j++)
+					with[p.present[j]] += secs;
+		} else for (j = 0; j < p.len; j++)
+			for (k = j + 1; k < p.len; k++) {
+				unsigned a = p.present[j], b = p.present[k];
+				if (a < b)
+					pairs_add(&pairs, a, b, secs);
+				else
+					pairs_add(&pairs, b, a, secs);
+			}
+	}
+
+	presence_free(&p);
+	free(isplits);
+
+	if (with) {
+		unsigned ids = ids_len(), m = 0;
+		struct duration *durs = (struct duration *)
+			calloc(ids, sizeof(struct duration));
+
+		for (j = 0; j < ids; j++)
+			if (with[j] && j != id) {
+				durs[m].who = j;
+				durs[m++].total = with[j];
+			}
+
+		qsort(durs, m, sizeof(struct duration), duration_cmp);
+		for (j = 0; j < m; j++)
+			fprintf(out, "%s %ld\n", gi_get(durs[j].who),
+					(long) durs[j].total);
+
+		free(durs);
+		free(with);
+		return;
+	}
+
+	for (j = 0, k = 0; j < COPRESENCE_SIZE; j++)
+		if (pairs.tab[j].key)
+			pairs.tab[k++] = pairs.tab[j];
+
+	qsort(pairs.tab, k, sizeof(struct pair), pair_cmp);
+
+	if (pairs.full)
+		fprintf(out, "# truncated to %d pairs\n", COPRESENCE_MAX);
+
+	for (j = 0; j < k; j++) {
+		uint64_t key = pairs.tab[j].key - 1;
+		fprintf(out, "%s", gi_get(key >> 32));
+		fprintf(out, " %s %ld\n", gi_get(key & 0xffffffff),
+				(long) pairs.tab[j].total);
+	}
+
+	free(pairs.tab);
+}
+
+/* what PEAK found so far: the highest count, and when it happened */
+struct peak {
+	int value;
+	struct ti *tis; // only min and max are used
+	size_t len;
+};
+
+static void
+peak_step(time_t from, time_t to, int count, void *arg)
+{
+	struct peak *peak = arg;
+
+	if (count < peak->value)
+		return;
+
+	if (count > peak->value) {
+		peak->value = count;
+		peak->len = 0;
+	} else if (peak->len && peak->tis[peak->len - 1].max == from) {
+		peak->tis[peak->len - 1].max = to;
+		return;
+	}
+
+	peak->tis = realloc(peak->tis, sizeof(struct ti) * (peak->len + 1));
+	peak->tis[peak->len].min = from;
+	peak->tis[peak->len++].max = to;
+}
+
+/* print what PEAK finds in some sorted (and clipped) isplits */
+static void
+peak_print(FILE *out, struct isplit *isplits, size_t n, time_t min,
+		time_t max, int members)
+{
+	char min_str[DATE_MAX_LEN], max_str[DATE_MAX_LEN];
+	struct peak peak;
+	size_t i;
+
+	memset(&peak, 0, sizeof(peak));
+	isplits_walk(isplits, n, min, max, peak_step, &peak);
+
+	fprintf(out, "%d\n", peak.value);
+	for (i = 0; i < peak.len; i++)
+		fprintf(out, "%s %s\n", printtime_r(min_str, peak.tis[i].min),
+				printtime_r(max_str, peak.tis[i].max));
+
+	if (members && peak.len && peak.value) {
+		struct probe probe = { .ts = peak.tis[0].min, .pos = 0 };
+		char *buf = NULL;
+
+		isplits_sweep(isplits, n, &probe, 1, batch_collect, &buf);
+		fprintf(out, "# members\n%s", buf);
+		free(buf);
+	}
+
+	free(peak.tis);
+}
+
+/* Peak concurrency (PEAK MIN MAX [MEMBERS] [BY LEVEL]): the most people
+ * present at once between MIN and MAX, followed by the stretches of time
+ * when there were that many. It only keeps a count while walking the
+ * isplits. With MEMBERS, it also lists who was there at the start of the
+ * first of them. With BY, that is done for each group, under "# GROUP".
+ */
+static void
+query_peak(FILE *out, char *line)
+{
+	char word[16];
+	struct isplit *isplits;
+	time_t min, max;
+	size_t n, *off;
+	unsigned g, ids;
+	int members, level;
+
+	if (read_date(&min, &line) || read_date(&max, &line)) {
+		fprintf(out, "# error: invalid range\n");
+		return;
+	}
+	line += read_word(word, line, sizeof(word) - 1);
+
+	if ((members = !strcmp(word, "MEMBERS")))
+		line += read_word(word, line, sizeof(word) - 1);
+
+	if ((level = read_by(word, line)) < 0) {
+		fprintf(out, "# error: expected MEMBERS or BY LEVEL\n");
+		return;
+	}
+
+	n = isplits_get(&isplits, min, max, 1);
+
+	if (!level) {
+		peak_print(out, isplits, n, min, max, members);
+		free(isplits);
+		return;
+	}
+
+	off = isplits_group(isplits, n, level);
+	for (g = 0, ids = ids_len(); g < ids; g++) {
+		if (off[g] == off[g + 1])
+			continue;
+
+		fprintf(out, "# ");
+		group_print(out, g, level);
+		fprintf(out, "\n");
+		peak_print(out, isplits + off[g], off[g + 1] - off[g],
+				min, max, members);
+	}
+
+	free(off);
+	free(isplits);
+}
+
+/* a gap that GAPS is going through */
+struct gap {
+	FILE *out;
+	time_t minlen;
+	time_t from, to; // to == from if not in one
+};
+
+static void
+gap_print(struct gap *gap)
+{
+	char min_str[DATE_MAX_LEN], max_str[DATE_MAX_LEN];
+
+	if (gap->to > gap->from && gap->to - gap->from >= gap->minlen)
+		fprintf(gap->out, "%s %s\n", printtime_r(min_str, gap->from),
+				printtime_r(max_str, gap->to));
+}
+
+static void
+gap_step(time_t from, time_t to, int count, void *arg)
+{
+	struct gap *gap = arg;
+
+	if (count)
+		return;
+
+	if (gap->to != from) {
+		gap_print(gap);
+		gap->from = from;
+	}
+
+	gap->to = to;
+}
+
+/* Periods with nobody present (GAPS MIN MAX [MINLEN]), that last at least
+ * MINLEN (like 90, 10m or 1d). They are the stretches of [MIN, MAX) where
+ * the count of isplits_walk is zero, so no splits are needed for them.
+ */
+static void
+query_gaps(FILE *out, char *line)
+{
+	char minlen_str[32];
+	struct isplit *isplits;
+	struct gap gap;
+	time_t min, max;
+	size_t n;
+
+	if (read_date(&min, &line) || read_date(&max, &line)) {
+		fprintf(out, "# error: invalid range\n");
+		return;
+	}
+	read_word(minlen_str, line, sizeof(minlen_str) - 1);
+
+	memset(&gap, 0, sizeof(gap));
+	gap.out = out;
+	gap.from = gap.to = mtinf;
+	if (*minlen_str && (gap.minlen = read_duration(minlen_str)) < 0) {
+		fprintf(out, "# error: invalid minlen\n");
+		return;
+	}
+
+	n = isplits_get(&isplits, min, max, 1);
+	isplits_walk(isplits, n, min, max, gap_step, &gap);
+	gap_print(&gap);
+	free(isplits);
+}
+
+/* Summaries per bucket (ROLLUP MIN MAX): for each bucket (see -D) from the
+ * one MIN is in until MAX, its start, how many people were present, the
+ * seconds of presence in total, and the most that were present at once.
+ * Mostly read from the rollup db, one record per bucket.
+ */
+static void
+query_rollup(FILE *out, char *line)
+{
+	char date[DATE_MAX_LEN];
+	struct rollup *rs;
+	time_t min, max, start;
+	size_t n, k;
+
+	if (read_date(&min, &line) || read_date(&max, &line)) {
+		fprintf(out, "# error: invalid range\n");
+		return;
+	}
+
+	start = rollup_bucket(min);
+	if (max <= start || (max - start) / rollup_secs >= COUNT_MAX) {
+		fprintf(out, "# error: invalid range\n");
+		return;
+	}
+
+	n = (max - start + rollup_secs - 1) / rollup_secs;
+	rs = (struct rollup *) malloc(sizeof(struct rollup) * n);
+	rollup_get(start, n, rs);
+
+	for (k = 0; k < n; k++)
+		fprintf(out, "%s %u %ld %u\n",
+				printtime_r(date, start + k * rollup_secs),
+				rs[k].ids, (long) rs[k].total, rs[k].peak);
+
+	free(rs);
+}
+
+/* a WINDOW series being printed */
+struct window {
+	FILE *out;
+	uint64_t *last, *now; // who was present in the last row, and now
+	size_t n;
+	int deltas;
+};
+
+static void
+window_row(struct probe *probe, unsigned *present, size_t present_l,
+		void *arg)
+{
+	struct window *w = arg;
+	char date[DATE_MAX_LEN];
+	size_t i;
+
+	fprintf(w->out, "%s %zu\n", printtime_r(date, probe->ts), present_l);
+
+	if (!w->deltas)
+		return;
+
+	memset(w->now, 0, w->n * sizeof(uint64_t));
+	for (i = 0; i < present_l; i++)
+		bs_set(w->now, present[i]);
+
+	for (i = 0; i < w->n; i++) {
+		uint64_t in = w->now[i] & ~w->last[i],
+			 out = w->last[i] & ~w->now[i];
+
+		for (; in; in &= in - 1)
+			fprintf(w->out, "+ %s\n", gi_get(i * BS_BITS + __builtin_ctzll(in)));
+		for (; out; out &= out - 1)
+			fprintf(w->out, "- %s\n", gi_get(i * BS_BITS + __builtin_ctzll(out)));
 	}
+
+	memcpy(w->last, w->now, w->n * sizeof(uint64_t));
 }
 
-/* Fills the spaces between splits (or on empty splits) with splits from BST B,
- * in order to resolve the situation where none of the people are present for
- * periods of time within the billing period (the aforementined gaps).
+/* Sliding window series (WINDOW MIN MAX WIDTH STEP [DELTAS]): every STEP
+ * from MIN to MAX, how many people were present at some point of the WIDTH
+ * before it. Someone is in the window ending at t if they have an interval
+ * with min <= t < max + WIDTH, so this is a BATCH sweep with the ends of the
+ * intervals pushed WIDTH later. With DELTAS, each row is followed by who
+ * came in ("+ ID") and who went out ("- ID") of the window since the last.
  */
-static inline void
-splits_fill(struct split_tailq *splits, time_t min, time_t max)
+static void
+query_window(FILE *out, char *line)
 {
-	struct split *split, *tmp;
-	struct split_tailq more_splits;
-	time_t last_max;
+	char width_str[32], step_str[32], word[16];
+	struct isplit *isplits;
+	struct probe *probes;
+	struct window w;
+	time_t min, max, width, step, t;
+	size_t n, probes_l, i;
 
-	split = TAILQ_FIRST(splits);
-	if (!split) {
-		splits_get(splits, &pdbs, min, max);
+	if (read_date(&min, &line) || read_date(&max, &line)) {
+		fprintf(out, "# error: invalid range\n");
+		return;
+	}
+	line += read_word(width_str, line, sizeof(width_str) - 1);
+	line += read_word(step_str, line, sizeof(step_str) - 1);
+	read_word(word, line, sizeof(word) - 1);
+	width = read_duration(width_str);
+	step = read_duration(step_str);
+
+	if (width < 0 || step <= 0 || max < min || (max - min) / step >= COUNT_MAX) {
+		fprintf(out, "# error: invalid range, width or step\n");
 		return;
 	}
 
-	last_max = min;
-
-	if (split->min > last_max) {
-		struct split_tailq more_splits;
-		splits_get(&more_splits, &pdbs, last_max, split->min);
-		splits_concat_before(splits, &more_splits, split);
+	n = isplits_get(&isplits, min - width, max, 0);
+	for (i = 0; i < n; i++)
+		if (isplits[i].max && isplits[i].ts != tinf)
+			isplits[i].ts += width;
+	qsort(isplits, n, sizeof(struct isplit), isplit_cmp);
+
+	probes_l = (max - min) / step + 2;
+	probes = (struct probe *) malloc(sizeof(struct probe) * probes_l);
+	for (i = 0, t = min; t <= max && i < probes_l; i++, t = tz_add(t, step)) {
+		probes[i].ts = t;
+		probes[i].pos = i;
+	}
+	probes_l = i;
+
+	memset(&w, 0, sizeof(w));
+	w.out = out;
+	w.deltas = !strcmp(word, "DELTAS");
+	if (w.deltas) {
+		w.n = bs_len();
+		w.last = bs_create();
+		w.now = bs_create();
 	}
 
-	last_max = split->max;
+	isplits_sweep(isplits, n, probes, probes_l, window_row, &w);
 
-	TAILQ_FOREACH_SAFE(split, splits, entry, tmp) {
-		if (!split->count) {
-			struct split_tailq more_splits;
-			splits_get(&more_splits, &pdbs, split->min, split->max);
-			splits_concat_before(splits, &more_splits, split);
-			TAILQ_REMOVE(splits, split, entry);
-		}
+	free(w.last);
+	free(w.now);
+	free(probes);
+	free(isplits);
+}
 
-		last_max = split->max;
-	}
+/* resize the cache (see cache_set) */
+static void
+query_cache(FILE *out, char *line)
+{
+	char arg[32];
+	int ret;
 
-	if (max > last_max) {
-		struct split_tailq more_splits;
-		splits_get(&more_splits, &pdbs, last_max, max);
-		TAILQ_CONCAT(splits, &more_splits, entry);
+	if (snap.base) {
+		fprintf(out, "# read-only\n");
+		return;
 	}
+
+	read_word(arg, line, sizeof(arg) - 1);
+	ret = cache_set(arg);
+
+	if (ret)
+		fprintf(out, "# error: %s\n", db_strerror(ret));
+	else
+		cache_print(out);
 }
 
-/* adds debt for each person of the tail queue of splits to the payer of the
- * bill
- */
-static inline void
-splits_print(struct split_tailq *splits)
+/* show statistics about the db cache or the result cache */
+static void
+query_stats(FILE *out, char *line)
 {
-	struct split *split;
+	char what[16];
 
-	TAILQ_FOREACH(split, splits, entry) {
-		time_t interval = split->max - split->min;
-		printf("%ld", interval);
-		DB_ITER(split->whodb)
-			printf(" %s", gi_get(* (unsigned *) key.data));
-		printf("\n");
-	}
+	read_word(what, line, sizeof(what) - 1);
+
+	if (!strcmp(what, "results"))
+		rcache_print(out);
+	else if (snap.base)
+		fprintf(out, "# read-only\n");
+	else if (!strcmp(what, "cache"))
+		cache_print(out);
+	else
+		fprintf(out, "# error: unknown stats\n");
 }
 
-/* Frees a tail queue of splits */
+/* switch the dataset of the connection (see process_use) */
 static void
-splits_free(struct split_tailq *splits)
+query_use(FILE *out, char *line)
 {
-	struct split *split, *split_tmp;
+	char name[DS_NAME_MAX + 1];
 
-	TAILQ_FOREACH_SAFE(split, splits, entry, split_tmp) {
-		split->whodb->close(split->whodb, 0);
-		TAILQ_REMOVE(splits, split, entry);
-		free(split);
-	}
+	read_word(name, line, DS_NAME_MAX);
+
+	if (snap.base && *name)
+		fprintf(out, "# read-only\n");
+	else if (!snap.base && !ds_use(name))
+		fprintf(out, "# error: invalid dataset name\n");
 }
 
-/******
- * functions that process a valid type of line
- ******/
+static void query_explain(FILE *out, char *line);
 
-/* This function is for handling lines in the format:
- *
- * STOP <DATE> <PERSON_ID>
- *
- * It reads a PERSON_ID, and it checks if there is a correspondant graph node
- * (and so a numeric id). If there is one, it finishes the last intervals in
- * both BSTs (much like process_pause does for BST A). If there isn't a graph
- * node for that user (and therefore no numeric id), it generates one. Then it
- * inserts the time interval [-∞, DATE] (and the newly created id) into both
- * BSTs.
+/* Queries that start with one of these words are handled by the
+ * corresponding function, which receives the rest of the line. The others
+ * are handled by query_intervals.
  */
-static inline void
-process_stop(time_t ts, char *line)
-{
-	char username[USERNAME_MAX_LEN];
-	unsigned id;
+struct qcmd {
+	char *name;
+	void (*cb)(FILE *out, char *line);
+	int cache; // starts with MIN MAX and can go in the rcache
+} qcmds[] = {
+	{ "USE", query_use, 0 },
+	{ "BATCH", query_batch, 0 },
+	{ "COUNT", query_count, 1 },
+	{ "DURATION", query_duration, 1 },
+	{ "COPRESENCE", query_copresence, 1 },
+	{ "PEAK", query_peak, 1 },
+	{ "GAPS", query_gaps, 1 },
+	{ "ROLLUP", query_rollup, 1 },
+	{ "WINDOW", query_window, 1 },
+	{ "HISTORY", query_history, 0 },
+	{ "SNAPSHOT", query_snapshot, 0 },
+	{ "COMPACT", query_compact, 0 },
+	{ "CACHE", query_cache, 0 },
+	{ "STATS", query_stats, 0 },
+	{ "EXPLAIN", query_explain, 0 },
+	{ "WATCH", query_watch, 0 },
+	{ "JOIN", query_join, 0 },
+	{ NULL, NULL, 0 },
+};
 
-	line += read_word(username, line, sizeof(username));
-	id = g_find(username);
+/* find which named query a line is, if any */
+static struct qcmd *
+qcmd_find(char *line)
+{
+	struct qcmd *cmd;
 
-	if (id != g_notfound) {
-		if (ti_present(&pdbs, ts, id))
-			ti_finish_last(&pdbs, id, ts);
-	} else {
-		id = g_insert(username);
-		ti_insert(&pdbs, id, mtinf, ts);
+	for (cmd = qcmds; cmd->name; cmd++) {
+		size_t len = strlen(cmd->name);
+		if (!strncmp(line, cmd->name, len)
+				&& (!line[len] || isspace(line[len])))
+			return cmd;
 	}
+
+	return NULL;
 }
 
-/* This function is for handling lines in the format:
- *
- * START <DATE> <PERSON_ID> [<PHONE_NUMBER> <EMAIL> ... <NAME>]
- *
- * So it reads a textual person id, then it inserts it into the graph as a
- * node, generating a numeric id. Then it inserts the time interval [DATE, +∞]
- * along with that numeric id into both BST A and BST B.
+/* get the range of time a query reads intervals from (which can be wider
+ * than its MIN MAX), returns non-zero if its reply can't be kept in the
+ * rcache
  */
-static inline void
-process_start(time_t ts, char *line)
+static int
+query_range(struct qcmd *cmd, char *line, time_t *min, time_t *max)
 {
-	char username[USERNAME_MAX_LEN];
-	unsigned id;
+	char word[32];
+	time_t width;
 
-	line += read_word(username, line, sizeof(username));
-	id = g_find(username);
-	if (id == g_notfound)
-		id = g_insert(username);
-	if (!ti_present(&pdbs, ts, id))
-		ti_insert(&pdbs, id, ts, tinf);
-}
+	if (cmd) {
+		if (!cmd->cache)
+			return 1;
+		line += strlen(cmd->name);
+	} else if (*line == '*' || *line == '+')
+		line += 2;
 
-/******
- * etc
- ******/
+	// the query itself says what is wrong with a bad date
+	if (read_date(min, &line))
+		return 1;
 
-/* This function is what processes each line. For each of them, it first checks
- * if it starts with a "#", in other words, if it is totally commented out.
- * If it is, it ignores this line. If it isn't, it then proceeds to read a
- * word: the TYPE of operation or event that the line represents. It also reads
- * the DATE. After this, it checks what the TYPE of operation is. Depending on
- * that, it does different things. In all valid cases (and for every different
- * TYPE), it calls a function named process_<TYPE> (lowercase), all of these
- * functions receive the DATE that was read, and also a pointer to the part of
- * the line that wasn't read yet.
+	for (; isspace(*line); line++);
+
+	if (!*line)
+		*max = *min;
+	else if (read_date(max, &line))
+		return 1;
+
+	if (!cmd)
+		return 0;
+
+	if (cmd->cb == query_window) {
+		// someone is in a window up to WIDTH after they leave
+		read_word(word, line, sizeof(word) - 1);
+		if ((width = read_duration(word)) > 0)
+			*min -= width;
+	} else if (cmd->cb == query_rollup && *max > rollup_bucket(*min)) {
+		// whole buckets are read
+		*min = rollup_bucket(*min);
+		*max = *min + (*max - *min + rollup_secs - 1)
+			/ rollup_secs * rollup_secs;
+	}
+
+	return 0;
+}
+
+/* This is for queries in the format:
  *
- * Check out the functions in the section above to understand how these work
- * internally.
+ * EXPLAIN <QUERY>
+ *
+ * It shows how QUERY would go through the intervals ("path time" for the
+ * max index, "path id" for those of each person), how many it would read,
+ * and how many the other way would, as far as the planner knows (see
+ * plan_count). Only range queries and HISTORY go through the planner, and
+ * HISTORY only when it has MIN and MAX (otherwise it reads the hist chunks,
+ * the id path).
  */
 static void
-process_line(char *line)
+query_explain(FILE *out, char *line)
 {
-	char op_type_str[9], date_str[DATE_MAX_LEN];
-	time_t ts;
+	struct qcmd *cmd;
+	struct plan plan;
+	time_t min = mtinf, max;
+	unsigned who;
+
+	for (; isspace(*line); line++);
+	cmd = qcmd_find(line);
+
+	if (cmd && cmd->cb == query_history) {
+		line += read_id(&who, line + strlen(cmd->name)) + strlen(cmd->name);
+		if (who == g_notfound) {
+			fprintf(out, "# unknown id\n");
+			return;
+		}
+
+		if (!line_empty(line) && read_date(&min, &line)) {
+			fprintf(out, "# error: invalid date\n");
+			return;
+		}
 
-	if (line[0] == '#' || line[0] == '\n')
+		plan_who(&plan, &ds->pdbs, min, who);
+
+		// like HISTORY, only ask the planner about a bounded one
+		if (line_empty(line) || snap.base)
+			plan.path = PLAN_ID;
+	} else if (query_range(cmd, line, &min, &max)) {
+		fprintf(out, "# error: not a range query\n");
 		return;
+	} else
+		plan_ids(&plan, &ds->pdbs, min, qfilter);
 
-	line += read_word(op_type_str, line, sizeof(op_type_str));
-	line += read_ts(&ts, line);
+	plan_print(out, &plan);
+}
 
-	switch (*op_type_str) {
-	case 'S':
-		if (op_type_str[1] != 'T')
-			goto error;
+/* If a query ends with an option (like "TZ ZONE" or "ONLY IDS"), cut it
+ * off and return its argument (and its keyword in kw), otherwise NULL
+ */
+static char *
+query_opt(char *line, char **kw)
+{
+	static char *kws[] = { "TZ", "ONLY", "LIMIT", "AFTER", NULL };
+	char *end = line + strlen(line), *arg, *k;
+	size_t i, len;
 
-		switch(op_type_str[2]) {
-		case 'A':
-			return process_start(ts, line);
-		case 'O':
-			return process_stop(ts, line);
-		}
+	for (; end > line && isspace(end[-1]); end--);
+	for (arg = end; arg > line && !isspace(arg[-1]); arg--);
+	for (k = arg; k > line && isspace(k[-1]); k--);
+
+	if (k == arg)
+		return NULL;
+
+	for (i = 0; kws[i]; i++) {
+		len = strlen(kws[i]);
+		if ((size_t) (k - line) >= len && !strncmp(k - len, kws[i], len)
+				&& (k - len == line || isspace(k[-len - 1])))
+			break;
 	}
 
-error:
-	/* err(EXIT_FAILURE, "Invalid format"); */
+	if (!kws[i])
+		return NULL;
+
+	*end = '\0';
+	*kw = kws[i];
+	for (k -= len; k > line && isspace(k[-1]); k--);
+	*k = '\0';
+	return arg;
+}
+
+/* Reads the options at the end of a query, into qtz, qfilter and qpage.
+ * Returns what is wrong with them, if anything. All of them are read even
+ * then, so that a paged query gets its "# end" either way.
+ */
+static char *
+query_opts(char *line)
+{
+	char *kw, *arg, *end, *error = NULL;
+
+	memset(&qpage, 0, sizeof(qpage));
+
+	while ((arg = query_opt(line, &kw)))
+		if (!strcmp(kw, "ONLY"))
+			filter_set(arg);
+		else if (!strcmp(kw, "LIMIT")) {
+			qpage.paged = 1;
+			qpage.limit = strtoul(arg, &end, 10);
+			if (!qpage.limit || *end)
+				error = "invalid limit";
+		} else if (!strcmp(kw, "AFTER")) {
+			if (page_parse(arg))
+				error = "invalid token";
+		} else if (!(qtz = tz_get(arg)))
+			error = "unknown zone";
+
+	return error;
 }
 
+/* This function processes each query line. The reply is written to memory
+ * first, so that it goes out in one piece (and can be kept in the rcache).
+ */
 static void
 process_query(int fd, char *line)
 {
-	char buf[BUFSIZ * 3], *s;
-	int type = 0;
-	char *space;
-	time_t min;
+	char *buf = NULL, *key = strdup(line), *error;
+	size_t len = 0;
+	struct qcmd *cmd;
+	struct rcache_ent *ent;
+	time_t min, max;
+	int nocache;
+	FILE *out;
 
-	switch (*line) {
-		case '*':
-			type = 1;
-			line += 2;
-		case '+':
-			type = 2;
-			line += 2;
+	qconn = &conns[fd];
+
+	if ((error = query_opts(line))) {
+		char msg[64];
+		conn_write(fd, msg, snprintf(msg, sizeof(msg), "# error: %s\n%s",
+					error, qpage.paged ? "# end\n" : ""));
+		goto out;
 	}
 
-	s = buf;
-	s += sprintf(s, "# %s\n", line);
-	space = strchr(line, ' ');
-	line += read_ts(&min, line);
-	if (space) {
-		// https://softwareengineering.stackexchange.com/questions/363091/split-overlapping-ranges-into-all-unique-ranges/363096#363096
+	cmd = qcmd_find(line);
+	nocache = query_range(cmd, line, &min, &max);
 
-		time_t max;
-		struct split_tailq splits;
-		struct split *split;
-		unsigned id;
+	if (!nocache && (ent = rcache_get(key))) {
+		conn_write(fd, ent->reply, ent->len);
+		goto out;
+	}
 
-		read_ts(&max, line);
+	out = open_memstream(&buf, &len);
+	CBUG(!out);
 
-		splits_get(&splits, &pdbs, min, max);
-		splits_fill(&splits, min, max);
-		if (type == 1) TAILQ_FOREACH(split, &splits, entry) {
-			time_t interval = split->max - split->min;
-			s += sprintf(s, "%ld", interval);
-			DB_ITER(split->whodb)
-				dprintf(fd, " %s", gi_get(* (unsigned *) key.data));
-			s += sprintf(s, "\n");
-		} else {
-			DB *whodb = NULL;
-			who_init(&whodb);
-
-			TAILQ_FOREACH(split, &splits, entry) {
-				DB_ITER(split->whodb) {
-					unsigned who = * (unsigned *) key.data;
-					if (!who_get(whodb, who))
-						who_insert(whodb, who);
-				}
-			}
+	if (cmd) {
+		fprintf(out, "# %s\n", key);
+		cmd->cb(out, line + strlen(cmd->name));
+	} else
+		query_intervals(out, line);
 
-			if (type == 2) TAILQ_FOREACH(split, &splits, entry) {
-				DB_ITER(whodb) {
-					unsigned who = * (unsigned *) key.data;
-					if (!who_get(split->whodb, who))
-						who_remove(whodb, who);
-				}
-			}
+	if (qpage.paged && !qpage.full)
+		fprintf(out, "# end\n");
 
-			DB_ITER(whodb) {
-				unsigned who = * (unsigned *) key.data;
-				s += sprintf(s, "%s\n", gi_get(who));
-			}
+	fclose(out);
+	conn_write(fd, buf, len);
 
-			whodb->close(whodb, 0);
-		}
-		splits_free(&splits);
-	} else {
-		struct match_stailq matches;
-		struct match *match, *match_tmp;
-		unsigned matches_l = ti_intersect(&pdbs, &matches, min, min);
-		STAILQ_FOREACH_SAFE(match, &matches, entry, match_tmp) {
-			s += sprintf(s, "%s\n", gi_get(match->ti.who));
-			STAILQ_REMOVE_HEAD(&matches, entry);
-			free(match);
-		}
-	}
+	if (!nocache)
+		rcache_put(key, min, max, buf, len);
 
-	dprintf(fd, "%s", buf);
+	free(buf);
+out:
+	qtz = NULL;
+	filter_free();
+	free(key);
 }
 
 static inline void
 usage(char *prog)
 {
-	fprintf(stderr, "Usage: %s [-d] [-f FILE] [-C DIR] [-S PATH]\n", prog);
+	fprintf(stderr, "Usage: %s [-cd] [-f FILE] [-C DIR] [-S PATH] [-F SECS] [-g SECS] [-R AGE [-A FILE]] [-M SIZE[,N]] [-Q N] [-D SECS] [-U] [-m SNAP | -w SNAP]\n", prog);
 	fprintf(stderr, "    Options:\n");
 	fprintf(stderr, "        -f FILE   Change db filename (it.db)\n");
 	fprintf(stderr, "        -C DIR    Change db home (/var/lib/it)\n");
 	fprintf(stderr, "        -S PATH   Set socket path (/tmp/it-sock)\n");
+	fprintf(stderr, "        -F SECS   Max age of unflushed changes (5)\n");
+	fprintf(stderr, "        -g SECS   Merge intervals this close when compacting (0)\n");
+	fprintf(stderr, "        -R AGE    Expire intervals that ended AGE ago (e.g. 400d)\n");
+	fprintf(stderr, "        -A FILE   Append expired intervals to a gzip file\n");
+	fprintf(stderr, "        -M SIZE   Cache size (e.g. 256M), split in N regions\n");
+	fprintf(stderr, "        -Q N      Keep the replies to N range queries (256)\n");
+	fprintf(stderr, "        -D SECS   Size of the rollup buckets (1d)\n");
+	fprintf(stderr, "        -U        Build the rollups again and exit\n");
+	fprintf(stderr, "        -c        Compact the db and exit\n");
+	fprintf(stderr, "        -m SNAP   Serve queries from a snapshot file\n");
+	fprintf(stderr, "        -w SNAP   Write a snapshot file and exit\n");
 	fprintf(stderr, "        -d        Daemonize.\n");
 }
 
+/* Read what a connection has sent, and process the lines in it. Events
+ * (and rows of a JOIN) come one per line, so the start of one is kept until
+ * the rest of it arrives. Queries (after "EOF") don't need to end in a
+ * newline.
+ */
 int
 descr_read(int fd)
 {
-	char buf[BUFSIZ * 3], *line = NULL, *eol = NULL;
-	int query = 0;
-	int ret;
+	struct conn *c = &conns[fd];
+	char *line, *eol;
+	ssize_t ret;
 
-	// read INPUT
 	do {
-		memset(buf, 0, sizeof(buf));
-		ret = read(fd, buf, sizeof(buf));
+		if (c->out_len > CONN_OUT)
+			return 0; // until the replies are sent (see conn_write)
+
+		ret = read(fd, c->in + c->in_len, CONN_IN - c->in_len - 1);
 		switch (ret) {
 			case -1: if (errno == EAGAIN) return 0;
 			case 0: return -1;
 		}
 
-		line = buf;
-
-again:
-		eol = strchr(line, '\n');
-		if (eol)
-			*eol = '\0';
+		ret += c->in_len;
+		c->in[ret] = '\0';
+		c->in_len = 0;
+		line = c->in;
+
+		while (line - c->in < ret) {
+			int rows = !c->query || c->join; // not queries
+
+			eol = strchr(line, '\n');
+			if (eol)
+				*eol = '\0';
+			else if (rows && line > c->in) {
+				// keep the start of a line until the rest arrives
+				c->in_len = ret - (line - c->in);
+				memmove(c->in, line, c->in_len);
+				break;
+			} else if (rows && ret < CONN_IN - 1) {
+				c->in_len = ret;
+				break;
+			}
 
-		if (strcmp(line, "EOF")) {
-			if (query)
-				process_query(fd, line);
-			else
-				process_line(line);
-		} else
-			query = 1;
+			if (c->join)
+				join_row(fd, line);
+			else if (strcmp(line, "EOF")) {
+				if (c->query)
+					process_query(fd, line);
+				else
+					process_line(line);
+			} else
+				c->query = 1;
 
-		if (eol) {
-			eol ++;
-			if (eol - buf >= ret)
-				continue;
+			if (!eol)
+				break;
 
-			line = eol;
-			goto again;
+			line = eol + 1;
 		}
 	} while (1);
 
 	return 0;
 }
 
+/* serve the connections that select says are ready */
 void descr_proc() {
 	for (register int fd = 0; fd < FD_SETSIZE; fd++)
-		if (!FD_ISSET(fd, &fds_read)) ;
+		if (FD_ISSET(fd, &fds_write) && conn_flush(fd))
+			conn_close(fd);
+		else if (!FD_ISSET(fd, &fds_read)) ;
 		else if (fd == srv_fd) {
 			struct sockaddr_un addr;
 			socklen_t addr_len = (socklen_t)sizeof(addr);
 			int fd = accept(srv_fd, (struct sockaddr *) &addr, &addr_len);
 			if (fd <= 0)
 				continue;
+			CBUG(fcntl(fd, F_SETFL, O_NONBLOCK) == -1);
 			FD_SET(fd, &fds_active);
-		} else if (descr_read(fd) < 0) {
-			shutdown(fd, 2);
-			close(fd);
-			FD_CLR(fd, &fds_active);
-			FD_CLR(fd, &fds_read);
+			conns[fd].ds = ds_default;
+			conns[fd].in = malloc(CONN_IN);
+			CBUG(!conns[fd].in);
+		} else {
+			struct conn *c = &conns[fd];
+			int ret;
+
+			ds = c->ds;
+			ret = descr_read(fd);
+			c->ds = ds;
+
+			if (ret >= 0) ;
+			else if (c->out_len) {
+				// the rest of its replies goes out first
+				c->eof = 1;
+				FD_CLR(fd, &fds_active);
+				if (c->watch) {
+					free(c->watch);
+					c->watch = NULL;
+					watchers--;
+				}
+			} else
+				conn_close(fd);
 		}
 }
  
@@ -1198,13 +6311,19 @@ main(int argc, char *argv[])
 	char *fname = "it.db";
 	char *dbhome = "/var/lib/it/";
 	char *sockpath = "/tmp/it-sock";
+	char *snappath = NULL, *wsnappath = NULL;
+	char *cachearg = NULL;
+	int compact = 0, rebuild = 0;
 	ssize_t linelen;
 	size_t linesize;
-	int ret;
+	int ret = 0;
 	char c;
 
-	while ((c = getopt(argc, argv, "df:C:S:")) != -1) {
+	while ((c = getopt(argc, argv, "cdf:C:S:F:g:m:w:A:R:M:Q:D:U")) != -1) {
 		switch (c) {
+		case 'c':
+			compact = 1;
+			break;
 		case 'd':
 			pflags |= PF_DETACH;
 			break;
@@ -1217,14 +6336,92 @@ main(int argc, char *argv[])
 		case 'S':
 			sockpath = optarg;
 			break;
+		case 'F':
+			mt_delay = strtol(optarg, NULL, 10);
+			break;
+		case 'g':
+			compact_gap = strtol(optarg, NULL, 10);
+			break;
+		case 'R':
+			retain_secs = sscanduration(optarg);
+			break;
+		case 'A':
+			retain_archive = optarg;
+			break;
+		case 'M':
+			cachearg = optarg;
+			break;
+		case 'Q':
+			rcache_max = strtoul(optarg, NULL, 10);
+			break;
+		case 'D':
+			rollup_secs = sscanduration(optarg);
+			if (rollup_secs <= 0)
+				errx(1, "%s: invalid rollup bucket", optarg);
+			break;
+		case 'U':
+			rebuild = 1;
+			break;
+		case 'm':
+			snappath = optarg;
+			break;
+		case 'w':
+			wsnappath = optarg;
+			break;
 		default:
 			usage(*argv);
 			return 1;
+		}
+	}
+
+	if (snappath) {
+		// no dbs needed, the snapshot is all there is
+		if (snap_open(snappath))
+			errx(1, "%s: not a valid snapshot", snappath);
+		ds = ds_default = (struct dataset *) calloc(1, sizeof(struct dataset));
+		groups_init();
+	} else {
+		db_env_create(&dbe, 0);
+		if (cachearg && cache_set(cachearg))
+			errx(1, "%s: invalid cache size", cachearg);
+		CBUG(dbe->open(dbe, dbhome, DB_CREATE | DB_INIT_LOCK | DB_INIT_MPOOL, 0664));
+		ds_init(fname);
+
+		// the cache was sized for it, so we might as well warm it up
+		if (cachearg) {
+			SLIST_FOREACH(ds, &datasets, entry)
+				cache_load(&ds->pdbs);
+			ds = ds_default;
+		}
+	}
+
+	if (compact && !snap.base) {
+		struct compact_stats st;
+		unsigned next = 0;
+
+		memset(&st, 0, sizeof(st));
+		SLIST_FOREACH(ds, &datasets, entry) {
+			next = 0;
+			compact_some(&ds->pdbs, &next, ds->g_len, &st);
+		}
+		compact_print(stdout, "compacted", &st);
+		ds = ds_default;
+		goto out;
+	}
+
+	if (rebuild && !snap.base) {
+		SLIST_FOREACH(ds, &datasets, entry)
+			rollup_rebuild();
+		ds = ds_default;
+		goto out;
 	}
 
-	db_env_create(&dbe, 0);
-	CBUG(dbe->open(dbe, dbhome, DB_CREATE | DB_INIT_LOCK | DB_INIT_MPOOL, 0664));
-	dbs_init(fname);
+	if (wsnappath) {
+		ret = snap_write(wsnappath) < 0;
+		if (ret)
+			warn("%s", wsnappath);
+		goto out;
+	}
 
 	if ((pflags & PF_DETACH) && daemon(1, 1) != 0)
 		return 0;
@@ -1270,8 +6467,16 @@ main(int argc, char *argv[])
 		timeout.tv_sec = 1;
 		timeout.tv_usec = 0;
 
+		if (snap.base)
+			snap_check();
+
+		SLIST_FOREACH(ds, &datasets, entry)
+			if (ds->pdbs.mt_len && time(NULL) - ds->pdbs.mt_time >= mt_delay)
+				mt_flush(&ds->pdbs);
+
 		fds_read = fds_active;
-		int select_n = select(FD_SETSIZE, &fds_read, NULL, NULL, &timeout);
+		fds_write = fds_pending;
+		int select_n = select(FD_SETSIZE, &fds_read, &fds_write, NULL, &timeout);
 
 		switch (select_n) {
 		case -1:
@@ -1284,18 +6489,32 @@ main(int argc, char *argv[])
 			perror("select");
 			break;
 
-		case 0: continue;
+		case 0:
+			// idle, so we might as well expire and compact some
+			if (snap.base)
+				continue;
+
+			SLIST_FOREACH(ds, &datasets, entry) {
+				if (retain_secs)
+					retain_some(&ds->pdbs, RETAIN_BATCH);
+
+				compact_some(&ds->pdbs, &ds->compact_next,
+						COMPACT_BATCH, &ds->compact_bg);
+				rollup_some();
+			}
+			continue;
 		}
 
-		for (; select_n; select_n--)
-			descr_proc();
+		descr_proc();
 	}
 
-	CBUG(pdbs.max->close(pdbs.max, 0));
-	CBUG(pdbs.id->close(pdbs.id, 0));
-	CBUG(pdbs.ti->close(pdbs.ti, 0));
-	CBUG(igdb->close(igdb, 0));
-	CBUG(gdb->close(gdb, 0));
+out:
+	if (snap.base)
+		return EXIT_SUCCESS;
+
+	SLIST_FOREACH(ds, &datasets, entry)
+		dbs_close();
+	CBUG(dsdb->close(dsdb, 0));
 	dbe->close(dbe, 0);
-	return EXIT_SUCCESS;
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
 }